@@ -0,0 +1,97 @@
+#include "../src/allocator.hpp"
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+// build with -DDMA_LATENCY_STATS (see the `latency` make target)
+
+const int LIVE_SLOTS = 4096;
+const int OPERATIONS = 500000;
+
+// small deterministic generator so runs are comparable
+uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+uint64_t nextRandom(){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// mostly small objects with the occasional large one
+size_t randomSize(){
+    uint64_t r = nextRandom();
+    if (r % 100 == 0){
+        return 4096 + r % 65536;
+    }
+    return 8 + r % 512;
+}
+
+void printRow(const std::string& name, latency_op op){
+    latency_histogram hist;
+    if (!memory_latency_histogram(op, &hist)){
+        return;
+    }
+
+    double mean = hist.count ? (double)hist.total_cycles / hist.count : 0.0;
+
+    std::cout << std::left << std::setw(20) << name << std::right
+              << std::setw(10) << hist.count
+              << std::setw(10) << (uint64_t)mean
+              << std::setw(10) << latency_percentile(&hist, 0.50)
+              << std::setw(10) << latency_percentile(&hist, 0.99)
+              << std::setw(10) << latency_percentile(&hist, 0.999)
+              << std::setw(12) << hist.max_cycles << "\n";
+}
+
+int main(){
+    initialize_heap();
+
+    latency_histogram probe;
+    if (!memory_latency_histogram(LAT_ALLOC, &probe)){
+        std::cerr << "latency instrumentation is compiled out, rebuild with -DDMA_LATENCY_STATS\n";
+        return 1;
+    }
+
+    void* live[LIVE_SLOTS] = {};
+
+    // warming up the heap so the first extension is not part of the results
+    for (int i = 0; i < LIVE_SLOTS; i++){
+        live[i] = memory_alloc(randomSize());
+    }
+    memory_latency_reset();
+
+    // random replacement of live objects
+    for (int i = 0; i < OPERATIONS; i++){
+        int slot = nextRandom() % LIVE_SLOTS;
+        if (live[slot]){
+            memory_free(live[slot]);
+            live[slot] = nullptr;
+        } else {
+            live[slot] = memory_alloc(randomSize());
+        }
+    }
+
+    std::cout << "latency in cycles (bucket upper bounds)\n";
+    std::cout << std::left << std::setw(20) << "operation" << std::right
+              << std::setw(10) << "count"
+              << std::setw(10) << "mean"
+              << std::setw(10) << "p50"
+              << std::setw(10) << "p99"
+              << std::setw(10) << "p99.9"
+              << std::setw(12) << "max" << "\n";
+
+    printRow("alloc", LAT_ALLOC);
+    printRow("  fast hit", LAT_ALLOC_FAST_HIT);
+    printRow("  split", LAT_ALLOC_SPLIT);
+    printRow("  heap extension", LAT_ALLOC_HEAP_EXTEND);
+    printRow("free", LAT_FREE);
+    printRow("  no coalesce", LAT_FREE_FAST);
+    printRow("  coalesce", LAT_FREE_COALESCE);
+    printRow("extend_heap()", LAT_HEAP_EXTEND);
+
+    for (int i = 0; i < LIVE_SLOTS; i++){
+        if (live[i]) memory_free(live[i]);
+    }
+
+    return 0;
+}
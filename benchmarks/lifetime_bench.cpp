@@ -0,0 +1,106 @@
+#include "../src/allocator.hpp"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <cstring>
+
+// trace of request handling: every round allocates a batch of short lived temporaries,
+// a few of which are interleaved with objects that survive for the rest of the run
+
+const int ROUNDS = 2000;
+const int TEMPORARIES = 200;
+const int SURVIVOR_EVERY = 20; // one survivor per this many temporaries
+const int MAX_SURVIVORS = ROUNDS * TEMPORARIES / SURVIVOR_EVERY;
+
+const uint64_t SITE_TEMPORARY = 1;
+const uint64_t SITE_SURVIVOR = 2;
+
+uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+uint64_t nextRandom(){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// objects are written like real ones would be, so the resident set reflects the heap layout
+void* allocate(bool use_sites, size_t size, uint64_t site){
+    void* obj = use_sites ? memory_alloc_site(size, site) : memory_alloc(size);
+    memset(obj, 0xab, size);
+    return obj;
+}
+
+void runTrace(bool use_sites){
+    initialize_heap();
+
+    static void* survivors[MAX_SURVIVORS];
+    void* temporaries[TEMPORARIES];
+    int survivor_count = 0;
+
+    for (int round = 0; round < ROUNDS; round++){
+        for (int i = 0; i < TEMPORARIES; i++){
+            temporaries[i] = allocate(use_sites, 64 + nextRandom() % 2048, SITE_TEMPORARY);
+            if (i % SURVIVOR_EVERY == 0){
+                survivors[survivor_count++] = allocate(use_sites, 32 + nextRandom() % 96, SITE_SURVIVOR);
+            }
+        }
+        for (int i = 0; i < TEMPORARIES; i++){
+            memory_free(temporaries[i]);
+        }
+    }
+
+    heap_stats stats;
+    memory_get_stats(&stats);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // share of free memory that is not in the largest free block
+    double fragmentation = stats.free_bytes ? 1.0 - (double)stats.largest_free_block / stats.free_bytes : 0.0;
+
+    std::cout << std::left << std::setw(16) << (use_sites ? "site segregated" : "plain") << std::right
+              << std::setw(14) << stats.heap_size
+              << std::setw(14) << stats.allocated_bytes
+              << std::setw(14) << stats.free_bytes
+              << std::setw(12) << stats.free_blocks
+              << std::setw(14) << stats.largest_free_block
+              << std::setw(14) << std::fixed << std::setprecision(3) << fragmentation
+              << std::setw(14) << usage.ru_maxrss << std::endl;
+
+    if (use_sites){
+        std::cout << "survivor site predicted long lived: "
+                  << (memory_site_is_long_lived(SITE_SURVIVOR) ? "yes" : "no")
+                  << ", temporary site: "
+                  << (memory_site_is_long_lived(SITE_TEMPORARY) ? "yes" : "no") << std::endl;
+    }
+    for (int i = 0; i < survivor_count; i++){
+        memory_free(survivors[i]);
+    }
+}
+
+int main(){
+    std::cout << std::left << std::setw(16) << "mode" << std::right
+              << std::setw(14) << "heap bytes"
+              << std::setw(14) << "allocated"
+              << std::setw(14) << "free"
+              << std::setw(12) << "free blocks"
+              << std::setw(14) << "largest free"
+              << std::setw(14) << "fragmentation"
+              << std::setw(14) << "max rss (KB)" << std::endl;
+
+    // each mode gets a fresh process, and with it a fresh heap
+    bool modes[] = {false, true};
+    for (bool use_sites : modes){
+        pid_t child = fork();
+        if (child == 0){
+            runTrace(use_sites);
+            _exit(0);
+        }
+        waitpid(child, nullptr, 0);
+    }
+
+    return 0;
+}
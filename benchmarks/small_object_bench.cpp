@@ -0,0 +1,56 @@
+#include "../src/allocator.hpp"
+#include <iostream>
+#include <iomanip>
+#include <sys/resource.h>
+
+// memory footprint of many tiny objects, run once per heap layout (see the `small-objects` make target)
+
+const int OBJECTS = 1000000;
+
+uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+uint64_t nextRandom(){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+int main(){
+    initialize_heap();
+
+    static void* objects[OBJECTS];
+    size_t requested = 0;
+
+    for (int i = 0; i < OBJECTS; i++){
+        size_t size = 4 + nextRandom() % 21; // 4..24 bytes
+        objects[i] = memory_alloc(size);
+        ((char*)objects[i])[0] = 1; // touching the memory so it counts towards RSS
+        requested += size;
+    }
+
+    heap_stats stats;
+    memory_get_stats(&stats);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+#ifdef DMA_COMPACT_HEAP
+    const char* layout = "compact";
+#else
+    const char* layout = "default";
+#endif
+
+    std::cout << std::left << std::setw(10) << layout << std::right
+              << std::setw(14) << requested
+              << std::setw(14) << stats.allocated_bytes
+              << std::setw(12) << std::fixed << std::setprecision(2)
+              << (double)stats.allocated_bytes / OBJECTS
+              << std::setw(14) << stats.heap_size
+              << std::setw(12) << usage.ru_maxrss << std::endl;
+
+    for (int i = 0; i < OBJECTS; i++){
+        memory_free(objects[i]);
+    }
+
+    return 0;
+}
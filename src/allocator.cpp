@@ -1,25 +1,101 @@
+#include "allocator.hpp"
+#include "heap_snapshot.hpp"
 #include <iostream>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#ifdef DMA_LATENCY_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+#endif
 
 const size_t ALIGNMENT = 16; // Alignment size
 const size_t PROLOGUE_SIZE = 32; // Prologue Size
+const size_t CACHE_LINE_SIZE = 64; // Cache line size used by ALLOC_CACHE_ALIGNED
 
 void* heap_start;
+void* heap_brk; // program break as last set by this allocator, trimming is only safe while nobody else moved it
+
+// memory the heap in use lives in, only the sbrk heap can grow and shrink
+enum heap_backing {
+    HEAP_SBRK,
+    HEAP_FILE,
+    HEAP_SHARED
+};
+heap_backing heap_mode = HEAP_SBRK;
+
+#ifdef DMA_COMPACT_HEAP
+// compact heap: 32-bit tags and free list links, for heaps under 4GiB
+// blocks start 4 bytes short of an ALIGNMENT boundary so payloads stay ALIGNMENT aligned
+typedef uint32_t block_tag;
+typedef uint32_t free_link;
+const size_t LINK_UNIT = ALIGNMENT;                  // links count ALIGNMENT sized units
+const size_t HEAP_START_PHASE = ALIGNMENT - sizeof(block_tag); // heap_start % ALIGNMENT
+const size_t MAX_BLOCK_SIZE = UINT32_MAX & ~(ALIGNMENT-1);
+// the heap stays within what one tag can describe, so no coalesced block can outgrow its tag
+// (links could address UINT32_MAX * LINK_UNIT bytes)
+const size_t MAX_HEAP_SIZE = MAX_BLOCK_SIZE;
+#else
+typedef size_t block_tag;
+typedef size_t free_link;
+const size_t LINK_UNIT = 1;                          // links count bytes
+const size_t HEAP_START_PHASE = 0;                   // heap_start % ALIGNMENT
+const size_t MAX_BLOCK_SIZE = SIZE_MAX / 2;
+const size_t MAX_HEAP_SIZE = SIZE_MAX / 2;
+#endif
 
 // block header
 struct block_header {
-    size_t size_and_alloc_status;
+    block_tag size_and_alloc_status;
 };
 block_header* epilogue_ptr = nullptr; // pointer to epilogue
 
-// free block payload - contains pointer to the previous block and the next block
+// block an incremental memory_compact pass resumes at, nullptr to start a new pass
+// (always a block start: coalescing moves it to the merged block, trimming past it resets it)
+block_header* compact_cursor = nullptr;
+
+// free block payload - contains links to the previous and the next free block
+// a link is the block's offset from heap_start in LINK_UNITs rather than a pointer,
+// so a heap stays valid when it is mapped at a different address
 struct free_block_payload {
-    free_block_payload* prev;
-    free_block_payload* next;
+    free_link prev;
+    free_link next;
+};
+
+const free_link NO_BLOCK = 0; // offset 0 is the prologue, so it never names a free block
+
+// heap control data, lives inside the mapping for file backed heaps
+struct heap_control {
+    free_link free_list_head; // explicit free list
+    size_t root;              // root object of a persistent heap
 };
 
-free_block_payload* free_list_head = nullptr; // explicit free list
+heap_control sbrk_control = {NO_BLOCK, NO_BLOCK};
+heap_control* heap_ctl = &sbrk_control; // control data of the heap in use
+
+// helper function to turn a free list link into a payload pointer
+free_block_payload* payloadAt(free_link link){
+    if (link == NO_BLOCK){
+        return nullptr;
+    }
+    return (free_block_payload *)((char *)heap_start + (size_t)link * LINK_UNIT + sizeof(block_header));
+}
+
+// helper function to turn a payload pointer into a free list link
+free_link payloadLink(free_block_payload* payload){
+    return ((char *)payload - sizeof(block_header) - (char *)heap_start) / LINK_UNIT;
+}
 
 // -----------------------------------------------------------------------------------
 // utility functions
@@ -32,6 +108,15 @@ size_t aligned_size(size_t size){
 // setting heap extension size to be 4MB
 const size_t EXTEND_SIZE = aligned_size(1024 * 4096);
 
+// minimum free block size
+// header + free_block_payload + footer
+const size_t MIN_FREE_BLOCK_SIZE =
+    aligned_size(
+                sizeof(block_header) +
+                sizeof(free_block_payload) +
+                sizeof(block_header)
+                );
+
 // -----------------------------------------------------------------------------------
 
 // -----------------------------------------------------------------------------------
@@ -51,7 +136,7 @@ size_t getBlockSize(block_header *blk){
 // helper function to set block's size
 void setBlockSize(block_header *blk, size_t size) {
     size_t flags = blk->size_and_alloc_status & (ALIGNMENT-1);
-    blk->size_and_alloc_status = size | flags;
+    blk->size_and_alloc_status = (block_tag)(size | flags);
 
     if (size == 0) return; // epilogue, no footer
 
@@ -78,6 +163,150 @@ void setAllocStatus(block_header *blk, bool alloc_status){
     footer->size_and_alloc_status = blk->size_and_alloc_status;
 }
 
+// block flags, kept in the low bits of the tag next to the allocation status
+const size_t HANDLE_FLAG = 0x2; // block belongs to a handle and may be moved by the compactor
+const size_t SITE_FLAG = 0x4;   // block carries a site_trailer for lifetime sampling
+
+// helper function to get one of the block's flags
+bool getFlag(block_header *blk, size_t flag){
+    return blk->size_and_alloc_status & flag;
+}
+
+// helper function to set one of the block's flags (header and footer)
+void setFlag(block_header *blk, size_t flag, bool value){
+    if (value){
+        blk->size_and_alloc_status |= flag;
+    }
+    else {
+        blk->size_and_alloc_status &= ~flag;
+    }
+
+    block_header* footer = (block_header*)((char*)blk + getBlockSize(blk) - sizeof(block_header));
+    footer->size_and_alloc_status = blk->size_and_alloc_status;
+}
+
+// helper function to write a fresh header and footer, clearing any stale flag bits
+// (the header is written in a single store, a block never shows up with a half written tag)
+void initBlock(block_header *blk, size_t size, bool alloc_status){
+    blk->size_and_alloc_status = (block_tag)(size | (alloc_status ? 0x1 : 0x0));
+
+    if (size == 0) return; // epilogue, no footer
+
+    block_header* footer = (block_header*)((char*)blk + size - sizeof(block_header));
+    footer->size_and_alloc_status = blk->size_and_alloc_status;
+}
+
+// -----------------------------------------------------------------------------------
+// latency instrumentation (compiled in with -DDMA_LATENCY_STATS)
+// -----------------------------------------------------------------------------------
+
+#ifdef DMA_LATENCY_STATS
+
+latency_histogram latency_histograms[LAT_OP_COUNT];
+
+// path taken by the operation currently being timed, only ever upgraded
+// (fast hit -> split -> heap extension) so the most expensive path wins
+latency_op latency_path = LAT_ALLOC_FAST_HIT;
+
+// reading the timestamp counter (or a nanosecond clock where there is no TSC)
+uint64_t readCycles(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// log2 bucket with LATENCY_SUB_BUCKETS linear sub-buckets per power of two
+size_t latencyBucket(uint64_t cycles){
+    if (cycles < LATENCY_SUB_BUCKETS){
+        return cycles;
+    }
+    size_t msb = 63 - __builtin_clzll(cycles);
+    size_t sub = (cycles >> (msb - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return (msb - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+void recordLatency(latency_op op, uint64_t cycles){
+    latency_histogram* hist = &latency_histograms[op];
+    hist->count++;
+    hist->total_cycles += cycles;
+    if (cycles > hist->max_cycles){
+        hist->max_cycles = cycles;
+    }
+    hist->buckets[latencyBucket(cycles)]++;
+}
+
+#define LATENCY_START(path) uint64_t latency_start = readCycles(); latency_path = (path)
+#define LATENCY_PATH(path) do { if ((path) > latency_path) latency_path = (path); } while (0)
+#define LATENCY_STOP(op) do { \
+        uint64_t latency_cycles = readCycles() - latency_start; \
+        recordLatency((op), latency_cycles); \
+        recordLatency(latency_path, latency_cycles); \
+    } while (0)
+
+#else
+
+#define LATENCY_START(path)
+#define LATENCY_PATH(path)
+#define LATENCY_STOP(op)
+
+#endif
+
+// upper bound (in cycles) of the values that land in a histogram bucket
+uint64_t latency_bucket_upper(size_t bucket){
+    if (bucket < LATENCY_SUB_BUCKETS){
+        return bucket;
+    }
+    size_t msb = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+    uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+    uint64_t step = 1ULL << (msb - LATENCY_SUB_BUCKET_BITS);
+    return (1ULL << msb) + (sub + 1) * step - 1;
+}
+
+// smallest bucket upper bound that covers the given fraction (0..1) of the samples
+uint64_t latency_percentile(const latency_histogram* hist, double fraction){
+    if (hist->count == 0){
+        return 0;
+    }
+
+    size_t target = (size_t)(fraction * hist->count);
+    if (target >= hist->count){
+        target = hist->count - 1;
+    }
+
+    size_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++){
+        seen += hist->buckets[i];
+        if (seen > target){
+            uint64_t upper = latency_bucket_upper(i);
+            return upper < hist->max_cycles ? upper : hist->max_cycles;
+        }
+    }
+    return hist->max_cycles;
+}
+
+bool memory_latency_histogram(latency_op op, latency_histogram* out){
+#ifdef DMA_LATENCY_STATS
+    if (op >= LAT_OP_COUNT || out == nullptr){
+        return false;
+    }
+    *out = latency_histograms[op];
+    return true;
+#else
+    (void)op;
+    (void)out;
+    return false;
+#endif
+}
+
+void memory_latency_reset(){
+#ifdef DMA_LATENCY_STATS
+    memset(latency_histograms, 0, sizeof(latency_histograms));
+#endif
+}
+
 // -----------------------------------------------------------------------------------
 // for debugging
 // -----------------------------------------------------------------------------------
@@ -107,7 +336,7 @@ void printAllBlocks(){
 // first fit algorithm for finding free blocks
 void* first_fit(size_t size){
     // creating a temp payload variable to iterate over the free list
-    free_block_payload* payload = free_list_head;
+    free_block_payload* payload = payloadAt(heap_ctl->free_list_head);
 
     while (payload){
         // getting free block's header
@@ -119,47 +348,212 @@ void* first_fit(size_t size){
         }
 
         // else, we keep iterating over the free list
-        payload = payload->next;
+        payload = payloadAt(payload->next);
     }
 
     return nullptr; // if no free block is found
 }
 
+// lowest block handed out to cold data so far, nullptr before the first one
+// hot fits stay below it while they can, so hot data stays dense at the low end
+block_header* cold_boundary = nullptr;
+
+// first fit for hot allocations: the first fitting block below the cold boundary,
+// or the first fitting block above it when there is none
+void* hot_fit(size_t size){
+    free_block_payload* payload = payloadAt(heap_ctl->free_list_head);
+    block_header* above = nullptr;
+
+    while (payload){
+        block_header* free_blk_header = (block_header *)((char *)payload - sizeof(block_header));
+
+        if (getBlockSize(free_blk_header)>=size){
+            if (cold_boundary == nullptr || free_blk_header < cold_boundary){
+                return free_blk_header;
+            }
+            if (above == nullptr){
+                above = free_blk_header;
+            }
+        }
+
+        payload = payloadAt(payload->next);
+    }
+
+    return above;
+}
+
+// moving the cold boundary down to a block just handed out to cold data
+void markCold(block_header* blk){
+    if (cold_boundary == nullptr || blk < cold_boundary){
+        cold_boundary = blk;
+    }
+}
+
+// free block right below the epilogue, nullptr if the last block is allocated
+block_header* topFreeBlock(){
+    block_header* last_footer = (block_header *)((char *)epilogue_ptr - sizeof(block_header));
+    if (getAllocStatus(last_footer)){
+        return nullptr;
+    }
+    return (block_header *)((char *)epilogue_ptr - getBlockSize(last_footer));
+}
+
+// fitting blocks a cold fit compares before it settles for the highest of them
+const size_t COLD_FIT_CANDIDATES = 8;
+
+// highest address fit for cold allocations, keeps them away from the hot low end of the heap
+// the top block is checked without walking the list, otherwise the walk stops after
+// COLD_FIT_CANDIDATES fits, so a cold fit costs about as much as a first fit
+void* highest_fit(size_t size){
+    block_header* top = topFreeBlock();
+    if (top && getBlockSize(top) >= size){
+        return top;
+    }
+
+    free_block_payload* payload = payloadAt(heap_ctl->free_list_head);
+    block_header* best = nullptr;
+    size_t candidates = 0;
+
+    while (payload && candidates < COLD_FIT_CANDIDATES){
+        block_header* free_blk_header = (block_header *)((char *)payload - sizeof(block_header));
+
+        if (getBlockSize(free_blk_header)>=size){
+            candidates++;
+            if (free_blk_header > best){
+                best = free_blk_header;
+            }
+        }
+
+        payload = payloadAt(payload->next);
+    }
+
+    return best;
+}
+
+// padding needed in front of a block so that it starts on a cache line boundary
+// (the padding becomes a free block of its own, so it has to be 0 or at least MIN_FREE_BLOCK_SIZE)
+size_t cacheLinePadding(block_header* blk){
+    // lining up the block's ALIGNMENT boundary (the block itself, or its payload on a compact heap)
+    uintptr_t boundary = (uintptr_t)blk + (ALIGNMENT - HEAP_START_PHASE) % ALIGNMENT;
+    size_t pad = (CACHE_LINE_SIZE - (boundary % CACHE_LINE_SIZE)) % CACHE_LINE_SIZE;
+    if (pad != 0 && pad < MIN_FREE_BLOCK_SIZE){
+        pad += CACHE_LINE_SIZE;
+    }
+    return pad;
+}
+
+// first fit that also accounts for the padding needed to start on a cache line
+void* cache_aligned_fit(size_t size){
+    free_block_payload* payload = payloadAt(heap_ctl->free_list_head);
+
+    while (payload){
+        block_header* free_blk_header = (block_header *)((char *)payload - sizeof(block_header));
+
+        if (getBlockSize(free_blk_header) >= cacheLinePadding(free_blk_header) + size){
+            return free_blk_header;
+        }
+
+        payload = payloadAt(payload->next);
+    }
+
+    return nullptr;
+}
+
+// offset of the highest spot in a free block where a cache aligned block of size fits
+// (what is left on either side has to be 0 or at least MIN_FREE_BLOCK_SIZE), SIZE_MAX if there is none
+size_t cacheAlignedTailOffset(block_header* blk, size_t size){
+    size_t blk_size = getBlockSize(blk);
+    if (blk_size < size){
+        return SIZE_MAX;
+    }
+
+    // moving down from the end of the block to the closest cache line boundary
+    uintptr_t boundary = (uintptr_t)blk + (ALIGNMENT - HEAP_START_PHASE) % ALIGNMENT;
+    size_t offset = blk_size - size;
+    size_t misalignment = (boundary + offset) % CACHE_LINE_SIZE;
+    if (misalignment > offset){
+        return SIZE_MAX;
+    }
+    offset -= misalignment;
+
+    while (true){
+        size_t tail = blk_size - offset - size;
+        if ((offset == 0 || offset >= MIN_FREE_BLOCK_SIZE) && (tail == 0 || tail >= MIN_FREE_BLOCK_SIZE)){
+            return offset;
+        }
+        if (offset < CACHE_LINE_SIZE){
+            return SIZE_MAX;
+        }
+        offset -= CACHE_LINE_SIZE;
+    }
+}
+
+// highest_fit for cache aligned cold allocations
+void* cache_aligned_tail_fit(size_t size){
+    block_header* top = topFreeBlock();
+    if (top && cacheAlignedTailOffset(top, size) != SIZE_MAX){
+        return top;
+    }
+
+    free_block_payload* payload = payloadAt(heap_ctl->free_list_head);
+    block_header* best = nullptr;
+    size_t candidates = 0;
+
+    while (payload && candidates < COLD_FIT_CANDIDATES){
+        block_header* free_blk_header = (block_header *)((char *)payload - sizeof(block_header));
+
+        if (cacheAlignedTailOffset(free_blk_header, size) != SIZE_MAX){
+            candidates++;
+            if (free_blk_header > best){
+                best = free_blk_header;
+            }
+        }
+
+        payload = payloadAt(payload->next);
+    }
+
+    return best;
+}
+
 // removing block from free list
 void removeBlockFromFreeList(block_header *blk){
     free_block_payload* blk_payload = (free_block_payload *)((char *)blk + sizeof(block_header));
 
+    free_block_payload* prev_payload = payloadAt(blk_payload->prev);
+    free_block_payload* next_payload = payloadAt(blk_payload->next);
+
     // case 1: removing the head of the list
-    if (blk_payload->prev == nullptr) {
-        free_list_head = blk_payload->next;
-        if (blk_payload->next != nullptr) {
-            blk_payload->next->prev = nullptr;
+    if (prev_payload == nullptr) {
+        heap_ctl->free_list_head = blk_payload->next;
+        if (next_payload != nullptr) {
+            next_payload->prev = NO_BLOCK;
         }
     } else {
     // case 2: removing from middle or end
-        blk_payload->prev->next = blk_payload->next;
-        if (blk_payload->next != nullptr) {
-            blk_payload->next->prev = blk_payload->prev;
+        prev_payload->next = blk_payload->next;
+        if (next_payload != nullptr) {
+            next_payload->prev = blk_payload->prev;
         }
     }
 
-    // clearing pointers to prevent accidental reuse during coalescing
-    blk_payload->prev = nullptr;
-    blk_payload->next = nullptr;
+    // clearing links to prevent accidental reuse during coalescing
+    blk_payload->prev = NO_BLOCK;
+    blk_payload->next = NO_BLOCK;
 }
 
 // adding block to free list
 void addBlockToFreeList(block_header *blk_hdr){
     // setting the free block to be at the beginning of the freelist
     free_block_payload* payload = (free_block_payload *)((char *)blk_hdr + sizeof(block_header));
-    payload->prev = nullptr;
-    payload->next = free_list_head;
+    payload->prev = NO_BLOCK;
+    payload->next = heap_ctl->free_list_head;
 
-    if (free_list_head != nullptr) {
-        free_list_head->prev = payload;
+    free_block_payload* old_head = payloadAt(heap_ctl->free_list_head);
+    if (old_head != nullptr) {
+        old_head->prev = payloadLink(payload);
     }
 
-    free_list_head = payload;
+    heap_ctl->free_list_head = payloadLink(payload);
 }
 
 // initializing prologue, free block and epilogue
@@ -175,9 +569,9 @@ void initializePrologueAndEpilogue(size_t free_space){
     setAllocStatus(free_blk, 0);
     // initializing the free block's prev and next pointers
     free_block_payload* payload = (free_block_payload *)((char *)free_blk + sizeof(block_header));
-    payload->prev = nullptr;
-    payload->next = nullptr;
-    free_list_head = payload; // adding free block to the free list
+    payload->prev = NO_BLOCK;
+    payload->next = NO_BLOCK;
+    heap_ctl->free_list_head = payloadLink(payload); // adding free block to the free list
 
     // initialize epilogue
     epilogue_ptr = (block_header *)((char *)free_blk + free_space);
@@ -193,6 +587,13 @@ void initialize_heap(){
 
     size_t total_size = aligned_size(PROLOGUE_SIZE + EXTEND_SIZE + epilogue_size);
 
+    // making sure the heap starts HEAP_START_PHASE past an ALIGNMENT boundary, block placement relies on it
+    size_t misalignment = ((uintptr_t)sbrk(0) + ALIGNMENT - HEAP_START_PHASE) % ALIGNMENT;
+    if (misalignment != 0 && sbrk(ALIGNMENT - misalignment) == (void *) -1){
+        std::cerr << "Error initializing heap" << std::endl;
+        exit(-1);
+    }
+
     void* result = sbrk(total_size);
     if (result == (void *) -1){
         std::cerr << "Error initializing heap" << std::endl;
@@ -200,6 +601,7 @@ void initialize_heap(){
     }
 
     heap_start = result;
+    heap_brk = (char *)result + total_size;
     initializePrologueAndEpilogue(EXTEND_SIZE);
 }
 
@@ -209,15 +611,6 @@ void splitBlock(block_header* free_blk_hdr, size_t size_required){
     // getting current free block's size
     size_t free_blk_size = getBlockSize(free_blk_hdr);
 
-    // minimum required size of a free block for splitting
-    // header + free_block_payload + footer
-    const size_t MIN_FREE_BLOCK_SIZE =
-        aligned_size(
-                    sizeof(block_header) +
-                    sizeof(free_block_payload) +
-                    sizeof(block_header)
-                    );
-
     // calculating remaining size
     size_t remaining_size = free_blk_size - size_required;
 
@@ -225,20 +618,21 @@ void splitBlock(block_header* free_blk_hdr, size_t size_required){
     if (remaining_size >= MIN_FREE_BLOCK_SIZE){
         // yes remaining size is enough to create a free block
 
-        // setting our current free block (future allocated) header to have the required size info
-        setBlockSize(free_blk_hdr, size_required);
-
         // creating a new free block after required size amount of space
+        // (written before the current block shrinks, so the block walk stays intact at every step;
+        // recovery of mapped heaps relies on that)
         block_header* new_free_block = (block_header *)((char *)free_blk_hdr + size_required);
 
-        // setting new free block's size
-        setBlockSize(new_free_block, remaining_size);
+        // setting new free block's size and allocation status to be free
+        initBlock(new_free_block, remaining_size, 0);
 
-        // setting new free block's allocation status to be free
-        setAllocStatus(new_free_block, 0);
+        // setting our current free block (future allocated) header to have the required size info
+        setBlockSize(free_blk_hdr, size_required);
 
         // adding new free block to the free list
         addBlockToFreeList(new_free_block);
+
+        LATENCY_PATH(LAT_ALLOC_SPLIT);
     } else {
         // This ensures the footer is placed at the very end of the physical block.
         size_required = free_blk_size;
@@ -276,6 +670,10 @@ block_header* coalesce(block_header* free_blk){
                 size_t new_size = prev_block_size + free_blk_size;
                 setBlockSize(prev_block, new_size);
 
+                if (compact_cursor == free_blk){
+                    compact_cursor = prev_block;
+                }
+
                 // free_blk becomes prev_blk
                 free_blk = prev_block;
 
@@ -303,6 +701,10 @@ block_header* coalesce(block_header* free_blk){
 
         // setting the new block size
         setBlockSize(free_blk, new_size);
+
+        if (compact_cursor == next_block_header){
+            compact_cursor = free_blk;
+        }
     }
 
     return free_blk;
@@ -310,6 +712,114 @@ block_header* coalesce(block_header* free_blk){
 
 
 
+// -----------------------------------------------------------------------------------
+// memory limits
+// -----------------------------------------------------------------------------------
+
+size_t soft_heap_limit = 0; // 0 means no limit
+size_t hard_heap_limit = 0;
+
+struct pressure_callback_entry {
+    memory_pressure_callback callback;
+    void* context;
+};
+
+const size_t MAX_PRESSURE_CALLBACKS = 8;
+pressure_callback_entry pressure_callbacks[MAX_PRESSURE_CALLBACKS];
+
+bool relieving_pressure = false; // callbacks may allocate, which must not recurse into relief
+
+// relief runs once per crossing: disarmed once the heap has grown past the soft limit,
+// armed again when it is trimmed back under it
+bool pressure_armed = true;
+
+// handing the pages inside free blocks back to the OS, keeping the tags and links resident
+// (only for the sbrk heap, on shared mappings the pages would just be reread)
+size_t purgeFreePages(){
+    if (heap_mode != HEAP_SBRK){
+        return 0;
+    }
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t purged = 0;
+
+    for (free_block_payload* payload = payloadAt(heap_ctl->free_list_head); payload; payload = payloadAt(payload->next)){
+        block_header* blk = (block_header *)((char *)payload - sizeof(block_header));
+
+        uintptr_t start = (uintptr_t)payload + sizeof(free_block_payload);
+        uintptr_t end = (uintptr_t)blk + getBlockSize(blk) - sizeof(block_header);
+        start = (start + page_size - 1) & ~(page_size - 1);
+        end = end & ~(page_size - 1);
+
+        if (end > start && madvise((void *)start, end - start, MADV_DONTNEED) == 0){
+            purged += end - start;
+        }
+    }
+
+    return purged;
+}
+
+// soft limit reached: the allocator cleans up after itself first, then asks the application
+void relievePressure(size_t heap_size){
+    relieving_pressure = true;
+
+    memory_compact(SIZE_MAX); // packs free space at the top, without trimming it (see memory_compact)
+    purgeFreePages();
+
+    for (size_t i = 0; i < MAX_PRESSURE_CALLBACKS; i++){
+        if (pressure_callbacks[i].callback){
+            pressure_callbacks[i].callback(heap_size, soft_heap_limit, pressure_callbacks[i].context);
+        }
+    }
+
+    relieving_pressure = false;
+}
+
+// checking whether some free block already holds size bytes
+bool freeListHasFit(size_t size){
+    for (free_block_payload* payload = payloadAt(heap_ctl->free_list_head); payload; payload = payloadAt(payload->next)){
+        block_header* blk = (block_header *)((char *)payload - sizeof(block_header));
+        if (getBlockSize(blk) >= size){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool memory_set_limits(size_t soft_limit, size_t hard_limit){
+    if (soft_limit && hard_limit && soft_limit > hard_limit){
+        std::cerr << "[memory_set_limits] Warning: soft limit above the hard limit\n";
+        return false;
+    }
+
+    soft_heap_limit = soft_limit;
+    hard_heap_limit = hard_limit;
+    pressure_armed = true;
+    return true;
+}
+
+bool memory_add_pressure_callback(memory_pressure_callback callback, void* context){
+    for (size_t i = 0; i < MAX_PRESSURE_CALLBACKS; i++){
+        if (!pressure_callbacks[i].callback){
+            pressure_callbacks[i].callback = callback;
+            pressure_callbacks[i].context = context;
+            return true;
+        }
+    }
+    return false;
+}
+
+void memory_remove_pressure_callback(memory_pressure_callback callback, void* context){
+    for (size_t i = 0; i < MAX_PRESSURE_CALLBACKS; i++){
+        if (pressure_callbacks[i].callback == callback && pressure_callbacks[i].context == context){
+            pressure_callbacks[i].callback = nullptr;
+            pressure_callbacks[i].context = nullptr;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------------
+
 void moveEpilogue(size_t extend_size){
     // old epilogue
     block_header* old_epilogue = epilogue_ptr;
@@ -328,16 +838,12 @@ void moveEpilogue(size_t extend_size){
     addBlockToFreeList(final_free_blk);
 }
 
-void extend_heap(size_t min_size){
-
-    // minimum free block size
-    // header + free_block_payload + footer
-    const size_t MIN_FREE_BLOCK_SIZE =
-        aligned_size(
-                    sizeof(block_header) +
-                    sizeof(free_block_payload) +
-                    sizeof(block_header)
-                    );
+// making room for a block of min_size, returns false if the heap could not grow
+bool growHeap(size_t min_size){
+    // mapped heaps have a fixed capacity, the caller sees the allocation fail
+    if (heap_mode != HEAP_SBRK){
+        return false;
+    }
 
     size_t extend_size = aligned_size(min_size);
 
@@ -351,80 +857,1366 @@ void extend_heap(size_t min_size){
         extend_size = EXTEND_SIZE;
     }
 
+    size_t heap_size = (char *)epilogue_ptr + sizeof(block_header) - (char *)heap_start;
+
+    // crossing the soft limit, trying to get by without growing first
+    if (soft_heap_limit && heap_size + extend_size > soft_heap_limit && pressure_armed && !relieving_pressure){
+        relievePressure(heap_size + extend_size);
+        if (freeListHasFit(min_size)){
+            return true;
+        }
+        heap_size = (char *)epilogue_ptr + sizeof(block_header) - (char *)heap_start; // compaction may have trimmed
+    }
+
+    // at the hard limit, growing by just what is needed is still better than failing
+    if (hard_heap_limit && heap_size + extend_size > hard_heap_limit){
+        size_t needed = aligned_size(min_size) < MIN_FREE_BLOCK_SIZE ? MIN_FREE_BLOCK_SIZE : aligned_size(min_size);
+        if (heap_size + needed > hard_heap_limit){
+            return false;
+        }
+        extend_size = (hard_heap_limit - heap_size) & ~(ALIGNMENT-1);
+    }
+
+    // links and tags could no longer address the heap
+    if (extend_size > MAX_BLOCK_SIZE || heap_size + extend_size > MAX_HEAP_SIZE){
+        return false;
+    }
+
     void* new_heap = sbrk(extend_size); // extending the heap
     if (new_heap == (void *) -1){
         std::cerr << "Error extending heap" << std::endl;
-        exit(-1);
+        return false;
     } else {
+        heap_brk = (char *)new_heap + extend_size;
         moveEpilogue(extend_size); // moving epilogue
-        return;
+
+        // past the soft limit now, no more relief until the heap is back under it
+        if (soft_heap_limit && heap_size + extend_size > soft_heap_limit){
+            pressure_armed = false;
+        }
+        return true;
     }
 }
 
+// timing growHeap, failed attempts included since the ones at a limit are among the slowest
+// (the caller's next fit attempt finds the room either way)
+bool extend_heap(size_t min_size){
 
-// malloc
-void* memory_alloc(size_t size){
+#ifdef DMA_LATENCY_STATS
+    uint64_t extend_start = readCycles();
+#endif
 
-    // if size is 0
-    if (size == 0){
-        return nullptr;
-    }
+    bool extended = growHeap(min_size);
 
-    // aligned block size
-    // header + payload + footer
-    size_t requested_total = size + (2 * sizeof(block_header));
-    size_t new_size = aligned_size(requested_total);
+#ifdef DMA_LATENCY_STATS
+    recordLatency(LAT_HEAP_EXTEND, readCycles() - extend_start);
+#endif
+    LATENCY_PATH(LAT_ALLOC_HEAP_EXTEND);
 
-    // minimum free block size
-    // header + free_block_payload + footer
-    const size_t MIN_FREE_BLOCK_SIZE =
-        aligned_size(
-                    sizeof(block_header) +
-                    sizeof(free_block_payload) +
-                    sizeof(block_header)
-                    );
+    return extended;
+}
 
-    // making sure it is free block size compatible
-    if (new_size < MIN_FREE_BLOCK_SIZE){
-        new_size = MIN_FREE_BLOCK_SIZE;
-    }
 
-    block_header* blk = (block_header*) first_fit(new_size);
+// -----------------------------------------------------------------------------------
+// heap recovery and locking (mapped heaps)
+// -----------------------------------------------------------------------------------
 
-    if (!blk){
-        extend_heap(new_size);
-        blk = (block_header*) first_fit(new_size);
-        if (!blk) {
-          return nullptr;
+// rebuilding the free list from the block tags after a crash
+// the tags are written before the free list links, so they are the ones to trust;
+// neighbouring free blocks left uncoalesced are merged on the way
+bool rebuildFreeList(){
+    heap_ctl->free_list_head = NO_BLOCK;
+
+    block_header* blk = (block_header *)((char *)heap_start + PROLOGUE_SIZE);
+    while (blk < epilogue_ptr){
+        size_t blk_size = getBlockSize(blk);
+        if (blk_size == 0 || (char *)blk + blk_size > (char *)epilogue_ptr){
+            return false; // tags are broken, the heap cannot be walked
         }
-    }
 
-    // removing allocated block from the free list
-    removeBlockFromFreeList(blk);
+        if (!getAllocStatus(blk)){
+            block_header* next = (block_header *)((char *)blk + blk_size);
+            while (next < epilogue_ptr && !getAllocStatus(next) && getBlockSize(next) != 0 &&
+                   (char *)next + getBlockSize(next) <= (char *)epilogue_ptr){
+                blk_size += getBlockSize(next);
+                next = (block_header *)((char *)blk + blk_size);
+            }
 
-    // splitting the free block
-    splitBlock(blk, new_size);
+            initBlock(blk, blk_size, 0);
+            addBlockToFreeList(blk);
+        }
+
+        blk = (block_header *)((char *)blk + blk_size);
+    }
 
-    return (char*)blk + sizeof(block_header);
+    return blk == epilogue_ptr && getBlockSize(epilogue_ptr) == 0 && getAllocStatus(epilogue_ptr);
 }
 
-// free
-void memory_free(void* blk){
+// lock of a process-shared heap, nullptr for heaps private to this process
+pthread_mutex_t* heap_lock = nullptr;
+uint64_t* heap_recoveries = nullptr; // recovery counter kept next to the lock
 
-    if (blk == nullptr){
-        std::cerr << "[memory_free] Warning: attempting to free nullptr\n";
-        return;
+// taking the heap lock, false if the heap must not be touched: the lock could not be taken,
+// or its owner died and left tags that cannot be walked
+bool heapLock(){
+    if (!heap_lock){
+        return true;
     }
 
-    // getting the block header
-    block_header* blk_hdr = (block_header *) ((char *)blk - sizeof(block_header));
+    int result = pthread_mutex_lock(heap_lock);
+    if (result == EOWNERDEAD){
+        // the owner died half way through an operation, the tags are still walkable
+        // (see splitBlock) but the free list may not be
+        if (!rebuildFreeList()){
+            // unlocking without pthread_mutex_consistent leaves the lock unrecoverable,
+            // every later locker in every process gets ENOTRECOVERABLE
+            std::cerr << "[heap lock] Error: shared heap is corrupted\n";
+            pthread_mutex_unlock(heap_lock);
+            return false;
+        }
+        (*heap_recoveries)++;
+        pthread_mutex_consistent(heap_lock);
+        return true;
+    }
 
-    // marking the block free
-    setAllocStatus(blk_hdr, 0);
+    if (result != 0){
+        std::cerr << "[heap lock] Error: cannot lock the shared heap: " << strerror(result) << "\n";
+        return false;
+    }
+    return true;
+}
 
-    // coalescing
-    blk_hdr = coalesce(blk_hdr);
+void heapUnlock(){
+    if (heap_lock){
+        pthread_mutex_unlock(heap_lock);
+    }
+}
 
-    // adding back to free list
-    addBlockToFreeList(blk_hdr);
+// -----------------------------------------------------------------------------------
+// switching between heaps
+// -----------------------------------------------------------------------------------
+
+// a heap that is not in use right now
+struct saved_heap {
+    void* heap_start;
+    block_header* epilogue_ptr;
+    heap_control* heap_ctl;
+    heap_backing mode;
+    pthread_mutex_t* lock;
+    uint64_t* recoveries;
+    block_header* cold_boundary;
+};
+saved_heap sbrk_heap; // the sbrk heap, put aside while a mapped heap is in use
+
+// trading the heap in use for the one put aside
+void swapHeap(){
+    saved_heap in_use = {heap_start, epilogue_ptr, heap_ctl, heap_mode, heap_lock, heap_recoveries, cold_boundary};
+
+    heap_start = sbrk_heap.heap_start;
+    epilogue_ptr = sbrk_heap.epilogue_ptr;
+    heap_ctl = sbrk_heap.heap_ctl;
+    heap_mode = sbrk_heap.mode;
+    heap_lock = sbrk_heap.lock;
+    heap_recoveries = sbrk_heap.recoveries;
+    cold_boundary = sbrk_heap.cold_boundary;
+
+    sbrk_heap = in_use;
+}
+
+// switching the allocator over to a mapped heap
+void useMappedHeap(void* mapping, size_t header_size, size_t capacity, heap_control* control, heap_backing mode){
+    swapHeap();
+
+    heap_start = (char *)mapping + header_size;
+    // the epilogue sits in the last ALIGNMENT bytes of the heap
+    epilogue_ptr = (block_header *)((char *)heap_start + capacity - ALIGNMENT);
+    heap_ctl = control;
+    heap_mode = mode;
+    heap_lock = nullptr;
+    heap_recoveries = nullptr;
+    cold_boundary = nullptr;
+}
+
+// switching back to the sbrk heap
+void useSbrkHeap(){
+    swapHeap();
+}
+
+// whether ptr can be the payload of a block between start and end
+bool inHeapRange(void* ptr, void* start, block_header* end){
+    return (char *)ptr >= (char *)start + PROLOGUE_SIZE + sizeof(block_header) && (char *)ptr < (char *)end;
+}
+
+// splitting the free block from its high end, the allocated part is the tail of the block
+// returns the header of the allocated block
+block_header* splitBlockTail(block_header* free_blk_hdr, size_t size_required){
+    size_t free_blk_size = getBlockSize(free_blk_hdr);
+    size_t remaining_size = free_blk_size - size_required;
+
+    if (remaining_size < MIN_FREE_BLOCK_SIZE){
+        // not enough left over for a free block, handing out the whole block
+        setAllocStatus(free_blk_hdr, 1);
+        return free_blk_hdr;
+    }
+
+    LATENCY_PATH(LAT_ALLOC_SPLIT);
+
+    // the high part gets allocated (written first, see splitBlock)
+    block_header* alloc_blk = (block_header *)((char *)free_blk_hdr + remaining_size);
+    initBlock(alloc_blk, size_required, 1);
+
+    // the low part stays free
+    initBlock(free_blk_hdr, remaining_size, 0);
+    addBlockToFreeList(free_blk_hdr);
+
+    return alloc_blk;
+}
+
+// allocating from the head of the free list (most recently freed, still warm in cache),
+// hot allocations skip the blocks in the cold region while they can
+block_header* allocHot(size_t new_size, bool hot){
+    block_header* blk = (block_header*) (hot ? hot_fit(new_size) : first_fit(new_size));
+
+    if (!blk){
+        extend_heap(new_size);
+        blk = (block_header*) (hot ? hot_fit(new_size) : first_fit(new_size));
+        if (!blk) {
+          return nullptr;
+        }
+    }
+
+    // removing allocated block from the free list
+    removeBlockFromFreeList(blk);
+
+    // splitting the free block
+    splitBlock(blk, new_size);
+
+    return blk;
+}
+
+// allocating from the high end of the highest fitting free block
+block_header* allocCold(size_t new_size){
+    block_header* blk = (block_header*) highest_fit(new_size);
+
+    if (!blk){
+        extend_heap(new_size);
+        blk = (block_header*) highest_fit(new_size);
+        if (!blk) {
+          return nullptr;
+        }
+    }
+
+    removeBlockFromFreeList(blk);
+    blk = splitBlockTail(blk, new_size);
+    markCold(blk);
+    return blk;
+}
+
+// cold variant of allocCacheAligned, the block is carved from the high end of the highest fit
+block_header* allocCacheAlignedCold(size_t new_size){
+    block_header* blk = (block_header*) cache_aligned_tail_fit(new_size);
+
+    if (!blk){
+        // worst case padding is two cache lines plus a minimum free block
+        extend_heap(new_size + 2 * CACHE_LINE_SIZE + MIN_FREE_BLOCK_SIZE);
+        blk = (block_header*) cache_aligned_tail_fit(new_size);
+        if (!blk) {
+          return nullptr;
+        }
+    }
+
+    removeBlockFromFreeList(blk);
+
+    size_t blk_size = getBlockSize(blk);
+    size_t offset = cacheAlignedTailOffset(blk, new_size);
+    size_t tail = blk_size - offset - new_size;
+    block_header* aligned_blk = (block_header *)((char *)blk + offset);
+
+    if (offset != 0 || tail != 0){
+        LATENCY_PATH(LAT_ALLOC_SPLIT);
+    }
+
+    // written from the high end down, so the block walk stays intact (see splitBlock)
+    if (tail != 0){
+        block_header* tail_blk = (block_header *)((char *)aligned_blk + new_size);
+        initBlock(tail_blk, tail, 0);
+        addBlockToFreeList(tail_blk);
+    }
+
+    initBlock(aligned_blk, new_size, 1);
+
+    if (offset != 0){
+        initBlock(blk, offset, 0);
+        addBlockToFreeList(blk);
+    }
+
+    markCold(aligned_blk);
+    return aligned_blk;
+}
+
+// allocating a block whose payload has its cache lines to itself
+block_header* allocCacheAligned(size_t new_size, bool cold){
+    if (HEAP_START_PHASE == 0){
+        // the block starts and ends on cache line boundaries
+        new_size = CACHE_LINE_SIZE*((new_size+CACHE_LINE_SIZE-1)/CACHE_LINE_SIZE);
+    } else {
+        // the payload starts on a cache line, the header sits at the end of the line before;
+        // the payload lines are followed by an ALIGNMENT of room for the footer and the next
+        // block's header, which would otherwise land in the payload's last line
+        size_t payload = new_size - 2 * sizeof(block_header);
+        new_size = CACHE_LINE_SIZE*((payload+CACHE_LINE_SIZE-1)/CACHE_LINE_SIZE) + ALIGNMENT;
+    }
+
+    if (cold){
+        return allocCacheAlignedCold(new_size);
+    }
+
+    block_header* blk = (block_header*) cache_aligned_fit(new_size);
+
+    if (!blk){
+        // worst case padding is a cache line plus a minimum free block
+        extend_heap(new_size + CACHE_LINE_SIZE + MIN_FREE_BLOCK_SIZE);
+        blk = (block_header*) cache_aligned_fit(new_size);
+        if (!blk) {
+          return nullptr;
+        }
+    }
+
+    removeBlockFromFreeList(blk);
+
+    // giving the padding in front back to the free list
+    size_t pad = cacheLinePadding(blk);
+    if (pad != 0){
+        size_t blk_size = getBlockSize(blk);
+        block_header* aligned_blk = (block_header *)((char *)blk + pad);
+        initBlock(aligned_blk, blk_size - pad, 0);
+
+        initBlock(blk, pad, 0);
+        addBlockToFreeList(blk);
+
+        blk = aligned_blk;
+    }
+
+    splitBlock(blk, new_size);
+
+    return blk;
+}
+
+// -----------------------------------------------------------------------------------
+// lifetime segregation by allocation site
+// -----------------------------------------------------------------------------------
+
+// lifetimes are measured in bytes allocated between a block's allocation and its free
+uint64_t lifetime_clock = 0;
+
+// a sampled block keeps its site and birth time in a trailer right before its footer:
+// [header][user data ...][site_trailer][footer]
+struct site_trailer {
+    uint64_t site;
+    uint64_t birth;
+};
+
+struct site_entry {
+    uint64_t site;
+    uint64_t allocations;     // allocations seen, drives the sampling
+    uint64_t freed_samples;
+    uint64_t freed_lifetime;  // summed lifetime of the freed samples
+    uint64_t live_samples;
+    uint64_t live_birth_sum;  // summed birth time of the samples still alive
+};
+
+const size_t SITE_TABLE_SIZE = 1024;        // direct mapped, a colliding site takes the entry over
+const uint64_t SITE_LEARNING_SAMPLES = 32;  // every allocation is sampled until a site has this many
+const uint64_t SITE_SAMPLE_RATE = 16;       // afterwards one in this many is
+const uint64_t SITE_DECAY_SAMPLES = 1024;   // freed history is halved past this, so sites can change their mind
+const uint64_t SHORT_LIFETIME = 1024 * 1024; // sites whose objects live longer than this are long lived
+
+site_entry site_table[SITE_TABLE_SIZE];
+
+// table slot of a site, top 10 bits of a multiplicative hash (SITE_TABLE_SIZE entries)
+size_t siteSlot(uint64_t site){
+    return (site * 0x9E3779B97F4A7C15ULL) >> 54;
+}
+
+// finding (or taking over) the table entry of a site
+site_entry* getSiteEntry(uint64_t site){
+    site_entry* entry = &site_table[siteSlot(site)];
+
+    if (entry->site != site){
+        memset(entry, 0, sizeof(site_entry));
+        entry->site = site;
+    }
+    return entry;
+}
+
+// a site is long lived when the mean lifetime of its samples is past SHORT_LIFETIME
+// samples still alive count with their current age, so sites that never free are caught too
+bool predictLongLived(site_entry* entry){
+    uint64_t samples = entry->freed_samples + entry->live_samples;
+    if (samples < SITE_LEARNING_SAMPLES){
+        return false;
+    }
+
+    uint64_t live_age = entry->live_samples * lifetime_clock - entry->live_birth_sum;
+    return (entry->freed_lifetime + live_age) / samples >= SHORT_LIFETIME;
+}
+
+// recording the lifetime of a sampled block that is being freed
+void recordSiteFree(block_header* blk){
+    site_trailer* trailer = (site_trailer *)((char *)blk + getBlockSize(blk) - sizeof(block_header) - sizeof(site_trailer));
+
+    site_entry* entry = &site_table[siteSlot(trailer->site)];
+    // the site lost its entry to another one, or the block comes from before a restart
+    if (entry->site != trailer->site || entry->live_samples == 0 || trailer->birth > lifetime_clock){
+        return;
+    }
+
+    entry->live_samples--;
+    entry->live_birth_sum -= trailer->birth;
+    entry->freed_samples++;
+    entry->freed_lifetime += lifetime_clock - trailer->birth;
+
+    if (entry->freed_samples > SITE_DECAY_SAMPLES){
+        entry->freed_samples /= 2;
+        entry->freed_lifetime /= 2;
+    }
+}
+
+void* memory_alloc_site(size_t size, uint64_t site){
+    if (site == MEMORY_SITE_AUTO){
+        site = (uint64_t)__builtin_return_address(0);
+    }
+
+    // a sampled block also holds the trailer, the size must leave room for it
+    if (size > MAX_BLOCK_SIZE - 2 * ALIGNMENT - sizeof(site_trailer)){
+        return nullptr;
+    }
+
+    site_entry* entry = getSiteEntry(site);
+    unsigned int flags = predictLongLived(entry) ? ALLOC_COLD : ALLOC_HOT;
+
+    bool sample = entry->freed_samples + entry->live_samples < SITE_LEARNING_SAMPLES ||
+                  entry->allocations % SITE_SAMPLE_RATE == 0;
+    entry->allocations++;
+
+    if (!sample){
+        return memory_alloc_ex(size, flags);
+    }
+
+    void* payload = memory_alloc_ex(size + sizeof(site_trailer), flags);
+    if (!payload){
+        return nullptr;
+    }
+
+    // the trailer goes at the very end of the block, which may be larger than asked for
+    block_header* blk = (block_header *)((char *)payload - sizeof(block_header));
+    setFlag(blk, SITE_FLAG, 1);
+
+    site_trailer* trailer = (site_trailer *)((char *)blk + getBlockSize(blk) - sizeof(block_header) - sizeof(site_trailer));
+    trailer->site = site;
+    trailer->birth = lifetime_clock;
+
+    entry->live_samples++;
+    entry->live_birth_sum += lifetime_clock;
+
+    return payload;
+}
+
+bool memory_site_is_long_lived(uint64_t site){
+    site_entry* entry = &site_table[siteSlot(site)];
+    return entry->site == site && predictLongLived(entry);
+}
+
+// malloc with placement flags
+void* memory_alloc_ex(size_t size, unsigned int flags){
+
+    // if size is 0 (or too large for a block's tag)
+    if (size == 0 || size > MAX_BLOCK_SIZE - 2 * ALIGNMENT){
+        return nullptr;
+    }
+
+    // aligned block size
+    // header + payload + footer
+    size_t requested_total = size + (2 * sizeof(block_header));
+    size_t new_size = aligned_size(requested_total);
+
+    // making sure it is free block size compatible
+    if (new_size < MIN_FREE_BLOCK_SIZE){
+        new_size = MIN_FREE_BLOCK_SIZE;
+    }
+
+    LATENCY_START(LAT_ALLOC_FAST_HIT);
+
+    lifetime_clock += new_size;
+
+    block_header* blk = nullptr;
+    if (heapLock()){
+        if (flags & ALLOC_CACHE_ALIGNED){
+            blk = allocCacheAligned(new_size, flags & ALLOC_COLD);
+        } else if (flags & ALLOC_COLD){
+            blk = allocCold(new_size);
+        } else {
+            blk = allocHot(new_size, flags & ALLOC_HOT);
+        }
+
+        heapUnlock();
+    }
+
+    if (!blk){
+        LATENCY_STOP(LAT_ALLOC);
+        return nullptr;
+    }
+
+    void* payload = (char*)blk + sizeof(block_header);
+
+    if (flags & ALLOC_ZERO){
+        memset(payload, 0, size);
+    }
+
+    LATENCY_STOP(LAT_ALLOC);
+
+    return payload;
+}
+
+// malloc
+void* memory_alloc(size_t size){
+    return memory_alloc_ex(size, ALLOC_DEFAULT);
+}
+
+// free
+void memory_free(void* blk){
+
+    if (blk == nullptr){
+        std::cerr << "[memory_free] Warning: attempting to free nullptr\n";
+        return;
+    }
+
+    // every heap keeps its own free list, a block goes back to the heap it came from
+    if (!inHeapRange(blk, heap_start, epilogue_ptr)){
+        if (heap_mode != HEAP_SBRK && inHeapRange(blk, sbrk_heap.heap_start, sbrk_heap.epilogue_ptr)){
+            swapHeap();
+            memory_free(blk);
+            swapHeap();
+            return;
+        }
+        std::cerr << "[memory_free] Warning: pointer is not in any open heap\n";
+        return;
+    }
+
+    if (!heapLock()){
+        std::cerr << "[memory_free] Warning: heap is unusable, block not freed\n";
+        return;
+    }
+
+    LATENCY_START(LAT_FREE_FAST);
+
+    // getting the block header
+    block_header* blk_hdr = (block_header *) ((char *)blk - sizeof(block_header));
+    size_t blk_size = getBlockSize(blk_hdr);
+
+    if (getFlag(blk_hdr, SITE_FLAG)){
+        recordSiteFree(blk_hdr);
+    }
+
+    // marking the block free, dropping any flags it carried while allocated
+    initBlock(blk_hdr, blk_size, 0);
+
+    // coalescing
+    blk_hdr = coalesce(blk_hdr);
+    if (getBlockSize(blk_hdr) != blk_size){
+        LATENCY_PATH(LAT_FREE_COALESCE);
+    }
+
+    // adding back to free list
+    addBlockToFreeList(blk_hdr);
+
+    heapUnlock();
+
+    LATENCY_STOP(LAT_FREE);
+}
+
+// -----------------------------------------------------------------------------------
+// relocatable handles and compaction
+// -----------------------------------------------------------------------------------
+
+// a handle block is a normal block with the handle number stored right after the header:
+// [header][handle (+ padding)][user data ...][footer]
+// the compactor is free to move it as long as it is not pinned
+
+struct handle_entry {
+    block_header* blk; // nullptr while the entry is unused
+    size_t pins;       // pin count, or the next unused entry while the entry is unused
+};
+
+handle_entry* handle_table = nullptr;
+size_t handle_capacity = 0;
+size_t handle_free_head = 0; // first unused entry + 1, 0 if there is none
+
+const size_t INITIAL_HANDLE_CAPACITY = 256; // one page worth of entries
+
+// handle number plus padding, so the user data behind it starts on an ALIGNMENT boundary
+const size_t HANDLE_PREFIX_SIZE =
+    aligned_size(HEAP_START_PHASE + sizeof(block_header) + sizeof(memory_handle)) -
+    HEAP_START_PHASE - sizeof(block_header);
+
+// doubling the handle table, kept in its own mapping so it never sits in the heap
+// as an immovable block between the ones the compactor slides down
+bool growHandleTable(){
+    size_t new_capacity = handle_capacity ? handle_capacity * 2 : INITIAL_HANDLE_CAPACITY;
+
+    void* mapping;
+    if (handle_table){
+        mapping = mremap(handle_table, handle_capacity * sizeof(handle_entry),
+                         new_capacity * sizeof(handle_entry), MREMAP_MAYMOVE);
+    } else {
+        mapping = mmap(nullptr, new_capacity * sizeof(handle_entry),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (mapping == MAP_FAILED){
+        return false;
+    }
+    handle_entry* new_table = (handle_entry*) mapping;
+
+    // chaining the new entries into the unused list
+    for (size_t i = handle_capacity; i < new_capacity; i++){
+        new_table[i].blk = nullptr;
+        new_table[i].pins = (i + 1 < new_capacity) ? i + 2 : handle_free_head;
+    }
+    handle_free_head = handle_capacity + 1;
+
+    handle_table = new_table;
+    handle_capacity = new_capacity;
+    return true;
+}
+
+// looking up a live handle's entry
+handle_entry* getHandleEntry(memory_handle handle){
+    if (handle == 0 || handle > handle_capacity || handle_table[handle - 1].blk == nullptr){
+        return nullptr;
+    }
+    return &handle_table[handle - 1];
+}
+
+memory_handle memory_alloc_handle(size_t size){
+    // the handle table is process local, so handles only exist on the sbrk heap
+    // (size is bounded before the handle prefix is added to it, the sum must not wrap)
+    if (size == 0 || size > MAX_BLOCK_SIZE - 2 * ALIGNMENT - HANDLE_PREFIX_SIZE || heap_mode != HEAP_SBRK){
+        return 0;
+    }
+
+    if (handle_free_head == 0 && !growHandleTable()){
+        return 0;
+    }
+
+    void* payload = memory_alloc(size + HANDLE_PREFIX_SIZE);
+    if (!payload){
+        return 0;
+    }
+
+    // taking an unused entry
+    memory_handle handle = handle_free_head;
+    handle_entry* entry = &handle_table[handle - 1];
+    handle_free_head = entry->pins;
+
+    block_header* blk = (block_header *)((char *)payload - sizeof(block_header));
+    setFlag(blk, HANDLE_FLAG, 1);
+    *(memory_handle *)payload = handle;
+
+    entry->blk = blk;
+    entry->pins = 0;
+    return handle;
+}
+
+void* memory_pin(memory_handle handle){
+    handle_entry* entry = getHandleEntry(handle);
+    if (!entry){
+        return nullptr;
+    }
+
+    entry->pins++;
+    return (char *)entry->blk + sizeof(block_header) + HANDLE_PREFIX_SIZE;
+}
+
+void memory_unpin(memory_handle handle){
+    handle_entry* entry = getHandleEntry(handle);
+    if (!entry || entry->pins == 0){
+        std::cerr << "[memory_unpin] Warning: handle is not pinned\n";
+        return;
+    }
+
+    entry->pins--;
+}
+
+void memory_free_handle(memory_handle handle){
+    handle_entry* entry = getHandleEntry(handle);
+    if (!entry){
+        std::cerr << "[memory_free_handle] Warning: attempting to free an invalid handle\n";
+        return;
+    }
+
+    memory_free((char *)entry->blk + sizeof(block_header));
+
+    // giving the entry back
+    entry->blk = nullptr;
+    entry->pins = handle_free_head;
+    handle_free_head = handle;
+}
+
+// releasing free space at the top of the heap back to the OS, keeping `pad` bytes
+size_t memory_trim(size_t pad){
+    block_header* last_blk = topFreeBlock();
+    if (!last_blk){
+        return 0;
+    }
+
+    // someone else moved the program break, shrinking it would cut into their memory
+    if (heap_mode != HEAP_SBRK || sbrk(0) != heap_brk){
+        return 0;
+    }
+
+    size_t last_size = getBlockSize(last_blk);
+
+    size_t keep = 0;
+    if (pad != 0){
+        keep = aligned_size(pad);
+        if (keep < MIN_FREE_BLOCK_SIZE){
+            keep = MIN_FREE_BLOCK_SIZE;
+        }
+    }
+    if (keep >= last_size){
+        return 0;
+    }
+    size_t release = last_size - keep;
+
+    removeBlockFromFreeList(last_blk);
+    if (keep != 0){
+        initBlock(last_blk, keep, 0);
+        addBlockToFreeList(last_blk);
+    }
+
+    // moving the epilogue down and handing the memory back
+    epilogue_ptr = (block_header *)((char *)last_blk + keep);
+    initBlock(epilogue_ptr, 0, 1);
+
+    sbrk(-(intptr_t)release);
+    heap_brk = (char *)heap_brk - release;
+
+    if (cold_boundary >= epilogue_ptr){
+        cold_boundary = nullptr;
+    }
+    if (compact_cursor >= epilogue_ptr){
+        compact_cursor = nullptr;
+    }
+
+    // back under the soft limit, the next crossing relieves pressure again
+    if ((size_t)((char *)epilogue_ptr + sizeof(block_header) - (char *)heap_start) <= soft_heap_limit){
+        pressure_armed = true;
+    }
+
+    return release;
+}
+
+// sliding unpinned handle blocks down over the free blocks in front of them,
+// moving at most max_bytes per call so it can be run incrementally; a call picks the
+// walk up where the previous one stopped, so a pass visits every block only once
+size_t memory_compact(size_t max_bytes){
+    if (heap_mode != HEAP_SBRK){
+        return 0;
+    }
+
+    size_t moved = 0;
+    block_header* blk = compact_cursor ? compact_cursor : (block_header *)((char *)heap_start + PROLOGUE_SIZE);
+    compact_cursor = nullptr;
+
+    // same implicit block walk as printAllBlocks
+    while (getBlockSize(blk) != 0){
+        size_t blk_size = getBlockSize(blk);
+        block_header* next = (block_header *)((char *)blk + blk_size);
+
+        bool movable = !getAllocStatus(blk) &&
+                       getAllocStatus(next) && getBlockSize(next) != 0 &&
+                       getFlag(next, HANDLE_FLAG);
+
+        if (movable){
+            memory_handle handle = *(memory_handle *)((char *)next + sizeof(block_header));
+            handle_entry* entry = &handle_table[handle - 1];
+            size_t next_size = getBlockSize(next);
+
+            if (entry->pins == 0){
+                // out of budget for this round (the first move always happens so every call makes progress)
+                if (moved != 0 && moved + next_size > max_bytes){
+                    compact_cursor = blk;
+                    return moved;
+                }
+
+                removeBlockFromFreeList(blk);
+
+                // moving header, handle, data and footer in one go
+                memmove(blk, next, next_size);
+                entry->blk = blk;
+                moved += next_size;
+
+                // the free space now sits behind the moved block
+                block_header* free_blk = (block_header *)((char *)blk + next_size);
+                initBlock(free_blk, blk_size, 0);
+                free_blk = coalesce(free_blk);
+                addBlockToFreeList(free_blk);
+
+                blk = free_blk;
+                continue;
+            }
+        }
+
+        blk = next;
+    }
+
+    // the pass has reached the end of the heap, everything movable is packed at the bottom
+    // (not trimmed while relieving pressure, the heap is about to grow again)
+    if (!relieving_pressure){
+        memory_trim(EXTEND_SIZE);
+    }
+    return moved;
+}
+
+// -----------------------------------------------------------------------------------
+// heap statistics
+// -----------------------------------------------------------------------------------
+
+void collectStats(heap_stats* stats){
+    memset(stats, 0, sizeof(heap_stats));
+    stats->heap_size = (char *)epilogue_ptr + sizeof(block_header) - (char *)heap_start;
+
+    block_header* blk = (block_header *)((char *)heap_start + PROLOGUE_SIZE);
+    while (getBlockSize(blk) != 0){
+        size_t blk_size = getBlockSize(blk);
+
+        if (getAllocStatus(blk)){
+            stats->allocated_blocks++;
+            stats->allocated_bytes += blk_size;
+        } else {
+            stats->free_blocks++;
+            stats->free_bytes += blk_size;
+            if (blk_size > stats->largest_free_block){
+                stats->largest_free_block = blk_size;
+            }
+        }
+
+        blk = (block_header *)((char *)blk + blk_size);
+    }
+}
+
+void memory_get_stats(heap_stats* stats){
+    if (!heapLock()){
+        memset(stats, 0, sizeof(heap_stats));
+        return;
+    }
+    collectStats(stats);
+    heapUnlock();
+}
+
+// -----------------------------------------------------------------------------------
+// heap snapshots
+// -----------------------------------------------------------------------------------
+
+// records are staged in a fixed buffer on the stack and written out with write(2),
+// so taking a snapshot never allocates (and never disturbs the heap it describes)
+const size_t SNAPSHOT_BUFFER_SIZE = 4096;
+
+struct snapshot_writer {
+    int fd;
+    size_t used;
+    bool ok;
+    char buffer[SNAPSHOT_BUFFER_SIZE];
+};
+
+void snapshotFlush(snapshot_writer* writer){
+    size_t written = 0;
+    while (writer->ok && written < writer->used){
+        ssize_t n = write(writer->fd, writer->buffer + written, writer->used - written);
+        if (n <= 0){
+            writer->ok = false;
+        } else {
+            written += n;
+        }
+    }
+    writer->used = 0;
+}
+
+void snapshotWrite(snapshot_writer* writer, const void* data, size_t size){
+    if (writer->used + size > SNAPSHOT_BUFFER_SIZE){
+        snapshotFlush(writer);
+    }
+    memcpy(writer->buffer + writer->used, data, size);
+    writer->used += size;
+}
+
+bool memory_snapshot(const char* path){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0){
+        return false;
+    }
+
+    snapshot_writer writer;
+    writer.fd = fd;
+    writer.used = 0;
+    writer.ok = true;
+
+    if (!heapLock()){
+        close(fd);
+        return false;
+    }
+
+    heap_stats stats;
+    collectStats(&stats);
+
+    uint64_t free_list_count = 0;
+    for (free_block_payload* payload = payloadAt(heap_ctl->free_list_head); payload; payload = payloadAt(payload->next)){
+        free_list_count++;
+    }
+
+    snapshot_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.tag_size = sizeof(block_header);
+    hdr.heap_base = (uint64_t)heap_start;
+    hdr.heap_size = stats.heap_size;
+    hdr.allocated_blocks = stats.allocated_blocks;
+    hdr.allocated_bytes = stats.allocated_bytes;
+    hdr.free_blocks = stats.free_blocks;
+    hdr.free_bytes = stats.free_bytes;
+    hdr.largest_free_block = stats.largest_free_block;
+    hdr.block_count = stats.allocated_blocks + stats.free_blocks;
+    hdr.free_list_count = free_list_count;
+    snapshotWrite(&writer, &hdr, sizeof(hdr));
+
+    // the implicit block list, same walk as printAllBlocks
+    block_header* blk = (block_header *)((char *)heap_start + PROLOGUE_SIZE);
+    while (getBlockSize(blk) != 0){
+        snapshot_block record;
+        record.offset = (char *)blk - (char *)heap_start;
+        record.size = getBlockSize(blk);
+        record.flags = blk->size_and_alloc_status & (ALIGNMENT-1); // tag flag bits match SNAPSHOT_* flags
+        snapshotWrite(&writer, &record, sizeof(record));
+
+        blk = (block_header *)((char *)blk + record.size);
+    }
+
+    // the free list, in list order
+    for (free_block_payload* payload = payloadAt(heap_ctl->free_list_head); payload; payload = payloadAt(payload->next)){
+        uint64_t offset = (uint64_t)payloadLink(payload) * LINK_UNIT;
+        snapshotWrite(&writer, &offset, sizeof(offset));
+    }
+
+    snapshotFlush(&writer);
+    heapUnlock();
+
+    bool ok = writer.ok;
+    if (close(fd) != 0){
+        ok = false;
+    }
+    return ok;
+}
+
+// -----------------------------------------------------------------------------------
+// persistent (file backed) heap
+// -----------------------------------------------------------------------------------
+
+// file layout: [persistent_header, padded to a page][prologue][blocks ...][epilogue]
+// every link inside the heap is an offset from heap_start, so the file can be mapped anywhere
+
+const uint64_t PERSISTENT_MAGIC = 0x5041454850414d44ULL; // "DMAPHEAP"
+const uint64_t PERSISTENT_VERSION = 2;
+const size_t PERSISTENT_HEADER_SIZE = 4096 + HEAP_START_PHASE; // keeps heap_start page aligned (plus the phase)
+
+struct persistent_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t tag_size;     // sizeof(block_header), a compact heap file only opens in a compact build
+    uint64_t clean;        // 1 after a clean shutdown, 0 while a process has the heap open
+    uint64_t capacity;     // bytes of heap after the header
+    uint64_t base_address; // where the heap was last mapped, tried first when remapping
+    heap_control control;
+};
+
+persistent_header* persistent_hdr = nullptr;
+int persistent_fd = -1;
+
+// a mapped heap's capacity has to be aligned, hold the prologue, one free block and the epilogue,
+// and leave a free block the tags can describe
+bool validCapacity(size_t capacity){
+    return capacity == aligned_size(capacity) &&
+           capacity >= PROLOGUE_SIZE + MIN_FREE_BLOCK_SIZE + ALIGNMENT &&
+           capacity - PROLOGUE_SIZE - ALIGNMENT <= MAX_BLOCK_SIZE;
+}
+
+persistent_open_result memory_open_persistent(const char* path, size_t capacity){
+    if (heap_mode != HEAP_SBRK){
+        std::cerr << "[memory_open_persistent] Warning: a mapped heap is already open\n";
+        return PERSIST_FAILED;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0){
+        return PERSIST_FAILED;
+    }
+
+    // one process at a time, the lock goes away with the fd (also when the holder dies)
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0){
+        std::cerr << "[memory_open_persistent] Warning: " << path << " is open in another process\n";
+        close(fd);
+        return PERSIST_FAILED;
+    }
+
+    // looking for an existing heap in the file
+    persistent_header existing;
+    bool exists = pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) &&
+                  existing.magic == PERSISTENT_MAGIC;
+    void* hint = nullptr;
+
+    if (exists){
+        // the file has to hold the whole heap, touching a page past its end would raise SIGBUS
+        struct stat st;
+        if (existing.version != PERSISTENT_VERSION || existing.tag_size != sizeof(block_header) ||
+            !validCapacity(existing.capacity) || fstat(fd, &st) != 0 ||
+            (uint64_t)st.st_size < PERSISTENT_HEADER_SIZE + existing.capacity){
+            close(fd);
+            return PERSIST_FAILED;
+        }
+        capacity = existing.capacity;
+        hint = (void *)existing.base_address;
+    } else {
+        capacity = aligned_size(capacity);
+        if (!validCapacity(capacity) || ftruncate(fd, PERSISTENT_HEADER_SIZE + capacity) != 0){
+            close(fd);
+            return PERSIST_FAILED;
+        }
+    }
+
+    void* mapping = mmap(hint, PERSISTENT_HEADER_SIZE + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED){
+        close(fd);
+        return PERSIST_FAILED;
+    }
+
+    persistent_header* hdr = (persistent_header *) mapping;
+    useMappedHeap(mapping, PERSISTENT_HEADER_SIZE, capacity, &hdr->control, HEAP_FILE);
+
+    persistent_open_result result;
+    if (!exists){
+        // formatting the whole capacity as one free block, the file stays sparse until it is written
+        hdr->version = PERSISTENT_VERSION;
+        hdr->tag_size = sizeof(block_header);
+        hdr->capacity = capacity;
+        hdr->control.root = NO_BLOCK;
+        initializePrologueAndEpilogue(capacity - PROLOGUE_SIZE - ALIGNMENT);
+
+        // the magic goes in last, a crash before this point leaves a file that gets formatted again
+        __atomic_store_n(&hdr->magic, PERSISTENT_MAGIC, __ATOMIC_RELEASE);
+        result = PERSIST_CREATED;
+    } else if (hdr->clean){
+        result = PERSIST_RESUMED;
+    } else if (rebuildFreeList()){
+        result = PERSIST_RECOVERED;
+    } else {
+        std::cerr << "[memory_open_persistent] Error: heap in " << path << " is corrupted\n";
+        useSbrkHeap();
+        munmap(mapping, PERSISTENT_HEADER_SIZE + capacity);
+        close(fd);
+        return PERSIST_FAILED;
+    }
+
+    // until memory_close_persistent, a restart has to assume a crash
+    hdr->clean = 0;
+    hdr->base_address = (uint64_t)mapping;
+
+    persistent_hdr = hdr;
+    persistent_fd = fd;
+    return result;
+}
+
+bool memory_close_persistent(){
+    if (heap_mode != HEAP_FILE){
+        return false;
+    }
+
+    size_t mapping_size = PERSISTENT_HEADER_SIZE + persistent_hdr->capacity;
+
+    // flushing the heap before marking it clean, then flushing the marker
+    bool synced = msync(persistent_hdr, mapping_size, MS_SYNC) == 0;
+    persistent_hdr->clean = 1;
+    synced = synced && msync(persistent_hdr, PERSISTENT_HEADER_SIZE, MS_SYNC) == 0;
+
+    useSbrkHeap();
+    munmap(persistent_hdr, mapping_size);
+    close(persistent_fd);
+
+    persistent_hdr = nullptr;
+    persistent_fd = -1;
+    return synced;
+}
+
+void memory_set_root(void* ptr){
+    heap_ctl->root = memory_to_offset(ptr);
+}
+
+void* memory_get_root(){
+    return memory_from_offset(heap_ctl->root);
+}
+
+size_t memory_to_offset(void* ptr){
+    if (ptr == nullptr){
+        return NO_BLOCK;
+    }
+    return (char *)ptr - (char *)heap_start;
+}
+
+void* memory_from_offset(size_t offset){
+    if (offset == NO_BLOCK){
+        return nullptr;
+    }
+    return (char *)heap_start + offset;
+}
+
+// -----------------------------------------------------------------------------------
+// process-shared heap
+// -----------------------------------------------------------------------------------
+
+// layout: [shared_header, padded to a page][prologue][blocks ...][epilogue]
+// every process maps the heap wherever it likes, pointers passed between processes
+// have to go through memory_to_offset / memory_from_offset
+
+const uint64_t SHARED_MAGIC = 0x4445524148534d44ULL; // "DMSHARED"
+const uint64_t SHARED_VERSION = 1;
+const size_t SHARED_HEADER_SIZE = 4096 + HEAP_START_PHASE; // keeps heap_start page aligned (plus the phase)
+const int SHARED_ATTACH_TIMEOUT_MS = 1000; // how long to wait for another process to finish creating the heap
+
+struct shared_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t tag_size;
+    uint64_t capacity;
+    uint64_t ready;        // set once the creator has formatted the heap
+    uint64_t recoveries;   // times a process found the lock owner dead
+    pthread_mutex_t lock;  // process-shared, robust
+    heap_control control;
+};
+
+shared_header* shared_hdr = nullptr;
+
+// mapping the heap and, for the creating process, formatting it
+bool attachShared(int fd, size_t capacity, bool creator){
+    if (creator){
+        capacity = aligned_size(capacity);
+        if (!validCapacity(capacity) || ftruncate(fd, SHARED_HEADER_SIZE + capacity) != 0){
+            return false;
+        }
+    } else {
+        // the creator may not have sized the object yet
+        struct stat st;
+        int waited = 0;
+        while (true){
+            if (fstat(fd, &st) != 0){
+                return false;
+            }
+            if ((size_t)st.st_size > SHARED_HEADER_SIZE || waited >= SHARED_ATTACH_TIMEOUT_MS){
+                break;
+            }
+            usleep(1000);
+            waited++;
+        }
+        if ((size_t)st.st_size <= SHARED_HEADER_SIZE){
+            return false;
+        }
+        capacity = st.st_size - SHARED_HEADER_SIZE;
+    }
+
+    void* mapping = mmap(nullptr, SHARED_HEADER_SIZE + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED){
+        return false;
+    }
+    shared_header* hdr = (shared_header *) mapping;
+
+    if (creator){
+        hdr->magic = SHARED_MAGIC;
+        hdr->version = SHARED_VERSION;
+        hdr->tag_size = sizeof(block_header);
+        hdr->capacity = capacity;
+        hdr->recoveries = 0;
+
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&hdr->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        useMappedHeap(mapping, SHARED_HEADER_SIZE, capacity, &hdr->control, HEAP_SHARED);
+        initializePrologueAndEpilogue(capacity - PROLOGUE_SIZE - ALIGNMENT);
+
+        __atomic_store_n(&hdr->ready, 1, __ATOMIC_RELEASE);
+    } else {
+        int waited = 0;
+        while (!__atomic_load_n(&hdr->ready, __ATOMIC_ACQUIRE) && waited < SHARED_ATTACH_TIMEOUT_MS){
+            usleep(1000);
+            waited++;
+        }
+
+        if (!hdr->ready || hdr->magic != SHARED_MAGIC || hdr->version != SHARED_VERSION ||
+            hdr->tag_size != sizeof(block_header) || hdr->capacity != capacity){
+            munmap(mapping, SHARED_HEADER_SIZE + capacity);
+            return false;
+        }
+
+        useMappedHeap(mapping, SHARED_HEADER_SIZE, capacity, &hdr->control, HEAP_SHARED);
+    }
+
+    shared_hdr = hdr;
+    heap_lock = &hdr->lock;
+    heap_recoveries = &hdr->recoveries;
+    return true;
+}
+
+bool memory_open_shared(const char* name, size_t capacity){
+    if (heap_mode != HEAP_SBRK){
+        std::cerr << "[memory_open_shared] Warning: a mapped heap is already open\n";
+        return false;
+    }
+
+    // whoever manages to create the object formats the heap
+    bool creator = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST){
+        creator = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0){
+        return false;
+    }
+
+    bool attached = attachShared(fd, capacity, creator);
+    close(fd);
+    return attached;
+}
+
+bool memory_open_shared_fd(int fd, size_t capacity, bool create){
+    if (heap_mode != HEAP_SBRK){
+        std::cerr << "[memory_open_shared_fd] Warning: a mapped heap is already open\n";
+        return false;
+    }
+
+    // there is no atomic way to tell who got to an fd first, so the caller says who formats it;
+    // an object that is no longer empty is never formatted over
+    if (create){
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size != 0){
+            std::cerr << "[memory_open_shared_fd] Warning: only an empty object can be formatted\n";
+            return false;
+        }
+    }
+    return attachShared(fd, capacity, create);
+}
+
+bool memory_close_shared(){
+    if (heap_mode != HEAP_SHARED){
+        return false;
+    }
+
+    size_t mapping_size = SHARED_HEADER_SIZE + shared_hdr->capacity;
+
+    useSbrkHeap();
+    munmap(shared_hdr, mapping_size);
+    shared_hdr = nullptr;
+    return true;
+}
+
+uint64_t memory_shared_recoveries(){
+    return shared_hdr ? shared_hdr->recoveries : 0;
+}
+
+// -----------------------------------------------------------------------------------
+// heap reservation and prefaulting
+// -----------------------------------------------------------------------------------
+
+// faulting in every page of a range up front, so first touches later on cost nothing
+// writable is for memory no other process or thread writes to while this runs
+void prefaultRange(void* start, size_t length, bool writable){
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    char* first_page = (char *)((uintptr_t)start & ~(page_size - 1));
+    char* end = (char *)start + length;
+
+#ifdef MADV_POPULATE_WRITE
+    // one system call where the kernel supports it (Linux 5.14+)
+    if (madvise(first_page, end - first_page, MADV_POPULATE_WRITE) == 0){
+        return;
+    }
+#endif
+
+    if (!writable){
+        // a write back could undo what another process wrote in between (mapped heaps are
+        // written to outside the heap lock), reading only gets the pages in, not yet writable
+        madvise(first_page, end - first_page, MADV_WILLNEED);
+        for (char* page = first_page; page < end; page += page_size){
+            volatile char* byte = page < (char *)start ? (char *)start : page;
+            (void)*byte;
+        }
+        return;
+    }
+
+    // writing one byte of every page back with its own value faults the page in writable
+    // without disturbing the tags and free list links living in it
+    for (char* page = first_page; page < end; page += page_size){
+        volatile char* byte = page < (char *)start ? (char *)start : page;
+        *byte = *byte;
+    }
+}
+
+bool memory_reserve(size_t bytes, unsigned int flags){
+    if (!heapLock()){
+        return false;
+    }
+
+    bool ok = true;
+    size_t heap_size = (char *)epilogue_ptr + sizeof(block_header) - (char *)heap_start;
+
+    if (bytes > heap_size){
+        size_t extend_size = aligned_size(bytes - heap_size);
+        if (extend_size < MIN_FREE_BLOCK_SIZE){
+            extend_size = MIN_FREE_BLOCK_SIZE;
+        }
+
+        // mapped heaps cannot grow, tags and links must still be able to address the heap,
+        // and reserving never goes past the hard limit
+        if (heap_mode != HEAP_SBRK || extend_size > MAX_BLOCK_SIZE || heap_size + extend_size > MAX_HEAP_SIZE ||
+            (hard_heap_limit && heap_size + extend_size > hard_heap_limit)){
+            ok = false;
+        } else {
+            // growing to the target in one step
+            void* new_heap = sbrk(extend_size);
+            if (new_heap == (void *) -1){
+                ok = false;
+            } else {
+                heap_brk = (char *)new_heap + extend_size;
+                moveEpilogue(extend_size);
+                heap_size += extend_size;
+            }
+        }
+    }
+
+    if (ok && (flags & RESERVE_PREFAULT)){
+        prefaultRange(heap_start, heap_size, heap_mode == HEAP_SBRK);
+
+        // the allocator's own lazily touched tables (there are no size-class caches to fill)
+        prefaultRange(site_table, sizeof(site_table), true);
+#ifdef DMA_LATENCY_STATS
+        prefaultRange(latency_histograms, sizeof(latency_histograms), true);
+#endif
+    }
+
+    if (ok && (flags & RESERVE_LOCK)){
+        ok = mlock(heap_start, heap_size) == 0;
+    }
+
+    heapUnlock();
+    return ok;
 }
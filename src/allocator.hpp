@@ -2,10 +2,129 @@
 #define ALLOCATOR_H
 
 #include <cstddef>
+#include <cstdint>
+
+// flags for memory_alloc_ex
+const unsigned int ALLOC_DEFAULT = 0x0;
+const unsigned int ALLOC_ZERO = 0x1;          // zero-fill the payload
+const unsigned int ALLOC_CACHE_ALIGNED = 0x2; // block gets its cache lines to itself (no false sharing)
+const unsigned int ALLOC_HOT = 0x4;           // place at the low end of the heap, below the cold data while there is room
+const unsigned int ALLOC_COLD = 0x8;          // place at the high end of the heap, away from hot data (also with ALLOC_CACHE_ALIGNED)
+
+// latency instrumentation, only recorded when built with -DDMA_LATENCY_STATS
+// every sample goes into the histogram of its operation and of the path it took
+enum latency_op {
+    LAT_ALLOC,             // every memory_alloc / memory_alloc_ex
+    LAT_FREE,              // every memory_free
+    LAT_ALLOC_FAST_HIT,    // allocation served by a free block without splitting
+    LAT_ALLOC_SPLIT,       // allocation served by splitting a free block
+    LAT_ALLOC_HEAP_EXTEND, // allocation that had to extend the heap (whether that worked or not)
+    LAT_FREE_FAST,         // free without any neighbour to coalesce with
+    LAT_FREE_COALESCE,     // free that coalesced with a neighbour
+    LAT_HEAP_EXTEND,       // extend_heap() on its own, failed attempts included
+    LAT_OP_COUNT
+};
+
+// log2 buckets, each split into 2^LATENCY_SUB_BUCKET_BITS linear sub-buckets
+const size_t LATENCY_SUB_BUCKET_BITS = 2;
+const size_t LATENCY_SUB_BUCKETS = 1 << LATENCY_SUB_BUCKET_BITS;
+const size_t LATENCY_BUCKETS = 64 * LATENCY_SUB_BUCKETS;
+
+struct latency_histogram {
+    uint64_t count;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+// relocatable allocations, the compactor may move a handle's block while it is not pinned
+// (memory_pin returns its current address, valid until the matching memory_unpin)
+typedef size_t memory_handle; // 0 is never a valid handle
+
+// heap usage, gathered by walking every block
+struct heap_stats {
+    size_t heap_size;          // bytes between heap_start and the end of the epilogue
+    size_t allocated_blocks;
+    size_t allocated_bytes;    // including headers, footers and padding
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free_block;
+};
+
+// opening a file backed heap, the allocator works on it until memory_close_persistent
+enum persistent_open_result {
+    PERSIST_FAILED,
+    PERSIST_CREATED,  // new heap of the requested capacity
+    PERSIST_RESUMED,  // existing heap after a clean shutdown
+    PERSIST_RECOVERED // existing heap after a crash, free list rebuilt from the block tags
+};
+
+// lifetime segregation: allocations are tagged with their call site, sites whose
+// objects turn out to be long lived are placed like ALLOC_COLD, the rest like ALLOC_HOT
+const uint64_t MEMORY_SITE_AUTO = 0; // use the caller's return address as the site
+
+// flags for memory_reserve
+const unsigned int RESERVE_PREFAULT = 0x1; // fault every page of the heap in now
+const unsigned int RESERVE_LOCK = 0x2;     // mlock the heap so it stays resident
+
+// called when heap growth would cross the soft limit, after the allocator has compacted
+// and purged its own free memory; heap_size is the size the heap is about to grow to
+typedef void (*memory_pressure_callback)(size_t heap_size, size_t soft_limit, void* context);
 
 void initialize_heap();
 void* memory_alloc(size_t size);
-void memory_free(void* ptr);
+void* memory_alloc_ex(size_t size, unsigned int flags);
+void memory_free(void* ptr);            // sbrk blocks may be freed while a mapped heap is open
+void* memory_alloc_site(size_t size, uint64_t site);
+bool memory_site_is_long_lived(uint64_t site); // current prediction for a site
 void printAllBlocks();
 
+// grows the heap to at least `bytes` in one step (mapped heaps only up to their capacity),
+// optionally prefaulting and locking it, so the first requests don't pay for sbrk and page faults
+bool memory_reserve(size_t bytes, unsigned int flags);
+
+// heap size limits for the sbrk heap (0 = no limit): the heap only grows past the soft limit
+// when pressure relief did not free enough, relief runs again once the heap has been trimmed
+// back under it; past the hard limit memory_alloc returns nullptr. false if soft > hard
+bool memory_set_limits(size_t soft_limit, size_t hard_limit);
+bool memory_add_pressure_callback(memory_pressure_callback callback, void* context); // up to 8
+void memory_remove_pressure_callback(memory_pressure_callback callback, void* context);
+void memory_get_stats(heap_stats* stats);
+bool memory_snapshot(const char* path); // binary dump for tools/heap_analyzer, does not allocate
+
+memory_handle memory_alloc_handle(size_t size);
+void* memory_pin(memory_handle handle);
+void memory_unpin(memory_handle handle);
+void memory_free_handle(memory_handle handle);
+size_t memory_compact(size_t max_bytes); // returns the number of bytes moved, resumes where the last call stopped
+size_t memory_trim(size_t pad);          // returns the number of bytes given back to the OS
+
+// persistent heap: capacity is only used when the file does not hold a heap yet
+// the file may be mapped at a different address next time, so links between
+// objects should be stored as offsets (memory_to_offset / memory_from_offset)
+persistent_open_result memory_open_persistent(const char* path, size_t capacity);
+bool memory_close_persistent(); // marks the heap clean and switches back to the sbrk heap
+void memory_set_root(void* ptr);
+void* memory_get_root();
+size_t memory_to_offset(void* ptr);     // 0 for nullptr
+void* memory_from_offset(size_t offset);
+
+// process-shared heap in a POSIX shared memory object (memory_open_shared) or any shareable
+// fd such as a memfd (memory_open_shared_fd); one process formats it with `capacity`, the
+// others attach. For a name the first process to create the object formats it, for an fd
+// exactly one process passes create (and an empty object). Blocks may be freed by any
+// process, pointers are exchanged as offsets. Blocks of the sbrk heap can still be freed
+// while attached, memory_free tells the heaps apart by address.
+// If a process dies holding the heap lock, the next one rebuilds the free list.
+bool memory_open_shared(const char* name, size_t capacity);
+bool memory_open_shared_fd(int fd, size_t capacity, bool create);
+bool memory_close_shared(); // detaches and switches back to the sbrk heap
+uint64_t memory_shared_recoveries();
+
+// copies out the histogram of an operation/path, false if instrumentation is compiled out
+bool memory_latency_histogram(latency_op op, latency_histogram* out);
+void memory_latency_reset();
+uint64_t latency_bucket_upper(size_t bucket);
+uint64_t latency_percentile(const latency_histogram* hist, double fraction);
+
 #endif
@@ -0,0 +1,41 @@
+#ifndef HEAP_SNAPSHOT_H
+#define HEAP_SNAPSHOT_H
+
+#include <cstdint>
+
+// on-disk layout of memory_snapshot() files, shared with tools/heap_analyzer.cpp
+//
+// [snapshot_header][block_count x snapshot_block][free_list_count x uint64_t]
+//
+// blocks are in address order (the implicit block walk), the free list entries are
+// block offsets in free list order; all offsets are from heap_start, in bytes
+
+const uint64_t SNAPSHOT_MAGIC = 0x50414e53414d44ULL; // "DMASNAP"
+const uint32_t SNAPSHOT_VERSION = 1;
+
+const uint64_t SNAPSHOT_ALLOCATED = 0x1; // block is allocated
+const uint64_t SNAPSHOT_HANDLE = 0x2;    // block belongs to a relocatable handle
+const uint64_t SNAPSHOT_SITE = 0x4;      // block carries a lifetime sample
+
+struct snapshot_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t tag_size;      // 8, or 4 on a compact heap
+    uint64_t heap_base;     // address of heap_start when the snapshot was taken
+    uint64_t heap_size;
+    uint64_t allocated_blocks;
+    uint64_t allocated_bytes;
+    uint64_t free_blocks;
+    uint64_t free_bytes;
+    uint64_t largest_free_block;
+    uint64_t block_count;
+    uint64_t free_list_count;
+};
+
+struct snapshot_block {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t flags;
+};
+
+#endif
@@ -1,6 +1,15 @@
 #include "../src/allocator.hpp"
+#include "../src/heap_snapshot.hpp"
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <csignal>
+#include <sys/resource.h>
+#include <cstring>
 
 
 void printError(std::string& text){
@@ -431,6 +440,886 @@ void test_edge_cases() {
     }
 }
 
+// checking if two payloads share any cache line
+bool sharesCacheLine(void* a, size_t a_size, void* b, size_t b_size){
+    uintptr_t a_first = (uintptr_t)a / 64, a_last = ((uintptr_t)a + a_size - 1) / 64;
+    uintptr_t b_first = (uintptr_t)b / 64, b_last = ((uintptr_t)b + b_size - 1) / 64;
+    return a_first <= b_last && b_first <= a_last;
+}
+
+void test_alloc_flags() {
+    std::string msg = "Test 9: Allocation Flags";
+    printTestName(msg);
+
+    bool all_passed = true;
+
+    // zero-fill: dirtying a block, freeing it and getting it back zeroed
+    char* dirty = (char*)memory_alloc(96);
+    for (int i = 0; i < 96; i++) {
+        dirty[i] = 'Z';
+    }
+    memory_free(dirty);
+
+    char* zeroed = (char*)memory_alloc_ex(96, ALLOC_ZERO);
+    bool all_zero = zeroed != nullptr;
+    for (int i = 0; all_zero && i < 96; i++) {
+        if (zeroed[i] != 0) all_zero = false;
+    }
+    if (all_zero) {
+        printInfo("ALLOC_ZERO returned zero-filled memory");
+    } else {
+        std::string err = "FAILED: ALLOC_ZERO memory is not zeroed";
+        printError(err);
+        all_passed = false;
+    }
+
+    // cache line isolation: neighbours must not share cache lines with the isolated block
+    void* before = memory_alloc(8);
+    void* isolated = memory_alloc_ex(24, ALLOC_CACHE_ALIGNED);
+    void* after = memory_alloc(8);
+    void* isolated2 = memory_alloc_ex(24, ALLOC_CACHE_ALIGNED);
+
+    if (isolated && isolated2 &&
+        !sharesCacheLine(isolated, 24, before, 8) &&
+        !sharesCacheLine(isolated, 24, after, 8) &&
+        !sharesCacheLine(isolated, 24, isolated2, 24) &&
+        !sharesCacheLine(isolated2, 24, after, 8)) {
+        printInfo("ALLOC_CACHE_ALIGNED blocks do not share cache lines with neighbours");
+    } else {
+        std::string err = "FAILED: ALLOC_CACHE_ALIGNED block shares a cache line";
+        printError(err);
+        all_passed = false;
+    }
+
+    // nor with the neighbours' tags, which are written whenever a neighbour is allocated or freed
+    // (8 byte objects take 16 byte blocks on a compact heap, 32 otherwise)
+#ifdef DMA_COMPACT_HEAP
+    const size_t TAG = 4, SMALL_BLOCK = 16;
+#else
+    const size_t TAG = 8, SMALL_BLOCK = 32;
+#endif
+    if (isolated && isolated2 &&
+        !sharesCacheLine(isolated, 24, (char*)before - 2 * TAG + SMALL_BLOCK, TAG) &&
+        !sharesCacheLine(isolated, 24, (char*)after - TAG, TAG) &&
+        !sharesCacheLine(isolated2, 24, (char*)after - 2 * TAG + SMALL_BLOCK, TAG)) {
+        printInfo("ALLOC_CACHE_ALIGNED payloads do not share cache lines with neighbouring tags");
+    } else {
+        std::string err = "FAILED: ALLOC_CACHE_ALIGNED payload shares a cache line with a neighbouring tag";
+        printError(err);
+        all_passed = false;
+    }
+
+    // hot/cold placement: cold data goes to the high end of the heap
+    void* hot = memory_alloc_ex(64, ALLOC_HOT);
+    void* cold = memory_alloc_ex(64, ALLOC_COLD);
+    std::cout << "\033[35m" << "hot = " << hot << ", cold = " << cold << "\033[0m\n";
+    if (hot && cold && cold > hot) {
+        printInfo("ALLOC_COLD block placed above ALLOC_HOT block");
+    } else {
+        std::string err = "FAILED: ALLOC_COLD block not placed above ALLOC_HOT block";
+        printError(err);
+        all_passed = false;
+    }
+
+    // both flags together: isolated and still placed with the cold data
+    void* cold_isolated = memory_alloc_ex(24, ALLOC_CACHE_ALIGNED | ALLOC_COLD);
+    if (cold_isolated && cold_isolated > hot && !sharesCacheLine(cold_isolated, 24, cold, 64)) {
+        printInfo("ALLOC_CACHE_ALIGNED | ALLOC_COLD block isolated at the high end of the heap");
+    } else {
+        std::string err = "FAILED: ALLOC_CACHE_ALIGNED | ALLOC_COLD block lost its cold placement";
+        printError(err);
+        all_passed = false;
+    }
+
+    // a freed cold block is left to cold data while hot data still fits below the cold region
+    void* cold_upper = memory_alloc_ex(64, ALLOC_COLD);
+    void* cold_lower = memory_alloc_ex(64, ALLOC_COLD);
+    memory_free(cold_upper);
+    void* hot_after = memory_alloc_ex(64, ALLOC_HOT);
+    if (hot_after && hot_after < cold_lower) {
+        printInfo("ALLOC_HOT block stayed below the cold region");
+    } else {
+        std::string err = "FAILED: ALLOC_HOT block taken from the cold region";
+        printError(err);
+        all_passed = false;
+    }
+
+    memory_free(zeroed);
+    memory_free(before);
+    memory_free(isolated);
+    memory_free(after);
+    memory_free(isolated2);
+    memory_free(hot);
+    memory_free(cold);
+    memory_free(cold_isolated);
+    memory_free(cold_lower);
+    memory_free(hot_after);
+
+    if (all_passed) {
+        printTestPassed();
+    }
+}
+
+void test_latency_percentiles() {
+    std::string msg = "Test 10: Latency Histogram Percentiles";
+    printTestName(msg);
+
+    // building a histogram by hand: 990 samples in the bucket of 100 cycles, 10 in the bucket of 5000
+    latency_histogram hist = {};
+    size_t fast_bucket = 0, slow_bucket = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        if (fast_bucket == 0 && latency_bucket_upper(i) >= 100) fast_bucket = i;
+        if (slow_bucket == 0 && latency_bucket_upper(i) >= 5000) slow_bucket = i;
+    }
+    hist.buckets[fast_bucket] = 990;
+    hist.buckets[slow_bucket] = 10;
+    hist.count = 1000;
+    hist.max_cycles = 5000;
+
+    uint64_t p50 = latency_percentile(&hist, 0.50);
+    uint64_t p999 = latency_percentile(&hist, 0.999);
+    std::cout << "\033[35m" << "p50 = " << p50 << ", p99.9 = " << p999 << "\033[0m\n";
+
+    bool all_passed = true;
+    if (p50 >= 100 && p50 < 5000 && p999 == 5000) {
+        printInfo("Percentiles land in the right buckets");
+    } else {
+        std::string err = "FAILED: Percentiles do not match the histogram";
+        printError(err);
+        all_passed = false;
+    }
+
+    // the recording hooks, only there when built with -DDMA_LATENCY_STATS (make instrumented)
+    latency_histogram probe;
+    if (!memory_latency_histogram(LAT_ALLOC, &probe)) {
+        printInfo("Instrumentation compiled out, recording hooks not checked");
+        if (all_passed) printTestPassed();
+        return;
+    }
+
+    memory_latency_reset();
+    void* block = memory_alloc(64);
+    memory_free(block);
+
+    // a hard limit at the current heap size makes the next extension fail
+    heap_stats stats;
+    memory_get_stats(&stats);
+    memory_set_limits(0, stats.heap_size);
+    void* refused = memory_alloc(64 * 1024 * 1024);
+    memory_set_limits(0, 0);
+
+    latency_histogram alloc, free_hist, fast_hit, split, alloc_extend, extend, free_fast, free_coalesce;
+    memory_latency_histogram(LAT_ALLOC, &alloc);
+    memory_latency_histogram(LAT_FREE, &free_hist);
+    memory_latency_histogram(LAT_ALLOC_FAST_HIT, &fast_hit);
+    memory_latency_histogram(LAT_ALLOC_SPLIT, &split);
+    memory_latency_histogram(LAT_ALLOC_HEAP_EXTEND, &alloc_extend);
+    memory_latency_histogram(LAT_HEAP_EXTEND, &extend);
+    memory_latency_histogram(LAT_FREE_FAST, &free_fast);
+    memory_latency_histogram(LAT_FREE_COALESCE, &free_coalesce);
+
+    printInfo("Recorded " + std::to_string(alloc.count) + " allocations (" +
+              std::to_string(fast_hit.count + split.count) + " served, " +
+              std::to_string(alloc_extend.count) + " extending), " +
+              std::to_string(free_hist.count) + " frees");
+
+    if (block && !refused && alloc.count == 2 && free_hist.count == 1 &&
+        fast_hit.count + split.count == 1 && alloc_extend.count == 1 && extend.count == 1 &&
+        free_fast.count + free_coalesce.count == 1) {
+        printInfo("Every operation landed in its own and its path's histogram, failed allocation included");
+    } else {
+        std::string err = "FAILED: Recording hooks missed operations";
+        printError(err);
+        all_passed = false;
+    }
+
+    if (all_passed) {
+        printTestPassed();
+    }
+}
+
+void test_handle_compaction() {
+    std::string msg = "Test 11: Handles and Compaction";
+    printTestName(msg);
+
+    const int COUNT = 3000;
+    const size_t SIZE = 4000;
+    memory_handle handles[COUNT];
+
+    // filling well past the initial heap so there is something to trim afterwards
+    for (int i = 0; i < COUNT; i++) {
+        handles[i] = memory_alloc_handle(SIZE);
+        char* data = (char*)memory_pin(handles[i]);
+        for (size_t j = 0; j < SIZE; j++) {
+            data[j] = (char)i;
+        }
+        memory_unpin(handles[i]);
+    }
+
+    // fragmenting the heap
+    for (int i = 0; i < COUNT; i += 2) {
+        memory_free_handle(handles[i]);
+        handles[i] = 0;
+    }
+
+    heap_stats before;
+    memory_get_stats(&before);
+
+    // a pinned block must stay where it is
+    int pinned = 101;
+    void* pinned_addr = memory_pin(handles[pinned]);
+
+    // compacting incrementally, 1MB at a time
+    int rounds = 0;
+    while (memory_compact(1024 * 1024) > 0) {
+        rounds++;
+    }
+
+    heap_stats after;
+    memory_get_stats(&after);
+
+    printInfo("Compacted in " + std::to_string(rounds) + " rounds, heap " +
+              std::to_string(before.heap_size) + " -> " + std::to_string(after.heap_size) + " bytes");
+
+    bool intact = true;
+    for (int i = 1; i < COUNT; i += 2) {
+        char* data = (char*)memory_pin(handles[i]);
+        for (size_t j = 0; j < SIZE; j++) {
+            if (data[j] != (char)i) intact = false;
+        }
+        memory_unpin(handles[i]);
+    }
+
+    bool stayed = memory_pin(handles[pinned]) == pinned_addr;
+    memory_unpin(handles[pinned]);
+    memory_unpin(handles[pinned]);
+
+    // a size that would wrap around once the handle prefix is added
+    bool oversized_refused = memory_alloc_handle(SIZE_MAX - 3) == 0;
+
+    for (int i = 1; i < COUNT; i += 2) {
+        memory_free_handle(handles[i]);
+    }
+
+    if (!intact) {
+        std::string err = "FAILED: Data corrupted by compaction";
+        printError(err);
+    } else if (!stayed) {
+        std::string err = "FAILED: Pinned block was moved";
+        printError(err);
+    } else if (!oversized_refused) {
+        std::string err = "FAILED: Oversized handle allocation was not refused";
+        printError(err);
+    } else if (after.heap_size >= before.heap_size) {
+        std::string err = "FAILED: Heap was not trimmed after compaction";
+        printError(err);
+    } else {
+        printInfo("Data intact, pinned block untouched, heap trimmed");
+        printTestPassed();
+    }
+}
+
+// node of a list kept in the persistent heap, linked by offsets so it survives remapping
+struct persistent_node {
+    size_t next;
+    int value;
+};
+
+void test_persistent_heap() {
+    std::string msg = "Test 12: Persistent Heap";
+    printTestName(msg);
+
+    std::string path = "/tmp/dma_persistent_test_" + std::to_string(getpid()) + ".heap";
+    unlink(path.c_str());
+
+    // building a list and closing cleanly
+    bool created = memory_open_persistent(path.c_str(), 1024 * 1024) == PERSIST_CREATED;
+    size_t head = 0;
+    for (int i = 0; i < 100; i++) {
+        persistent_node* node = (persistent_node*)memory_alloc(sizeof(persistent_node));
+        node->value = i;
+        node->next = head;
+        head = memory_to_offset(node);
+    }
+    memory_set_root(memory_from_offset(head));
+    bool closed = memory_close_persistent();
+
+    // reopening and checking the list
+    bool resumed = memory_open_persistent(path.c_str(), 0) == PERSIST_RESUMED;
+    int sum = 0, count = 0;
+    for (persistent_node* node = (persistent_node*)memory_get_root(); node;
+         node = (persistent_node*)memory_from_offset(node->next)) {
+        sum += node->value;
+        count++;
+    }
+    memory_close_persistent();
+
+    // freeing across the switch: every block has to go back to the heap it came from
+    void* sbrk_front = memory_alloc(256);
+    void* sbrk_blk = memory_alloc(256);
+    void* sbrk_back = memory_alloc(256);
+    memory_open_persistent(path.c_str(), 0);
+    memory_free(sbrk_blk);
+    void* file_blk = memory_alloc(256);
+    bool stays_in_file = file_blk != sbrk_blk && memory_to_offset(file_blk) < 1024 * 1024;
+    void* file_stale = memory_alloc(64);
+    memory_free(file_blk);
+    memory_close_persistent();
+
+    // a file heap pointer freed after closing must be refused, not linked into the sbrk heap
+    memory_free(file_stale);
+    void* sbrk_again = memory_alloc(256);
+    bool sbrk_reused = sbrk_again == sbrk_blk;
+    memory_free(sbrk_again);
+    memory_free(sbrk_front);
+    memory_free(sbrk_back);
+    bool switch_resumed = memory_open_persistent(path.c_str(), 0) == PERSIST_RESUMED;
+    memory_close_persistent();
+
+    // a child that dies while holding the heap open, nobody else may open it meanwhile
+    int opened[2], checked[2];
+    bool piped = pipe(opened) == 0 && pipe(checked) == 0;
+    char token = 0;
+    pid_t child = fork();
+    if (child == 0) {
+        memory_open_persistent(path.c_str(), 0);
+        for (int i = 0; i < 50; i++) {
+            memory_alloc(64);
+        }
+        write(opened[1], &token, 1);
+        read(checked[0], &token, 1);
+        _exit(0);
+    }
+    bool child_opened = piped && read(opened[0], &token, 1) == 1;
+    bool held_exclusive = memory_open_persistent(path.c_str(), 0) == PERSIST_FAILED;
+    write(checked[1], &token, 1);
+    waitpid(child, nullptr, 0);
+    close(opened[0]); close(opened[1]); close(checked[0]); close(checked[1]);
+
+    bool recovered = memory_open_persistent(path.c_str(), 0) == PERSIST_RECOVERED;
+    int recovered_count = 0;
+    for (persistent_node* node = (persistent_node*)memory_get_root(); node;
+         node = (persistent_node*)memory_from_offset(node->next)) {
+        recovered_count++;
+    }
+    void* after_recovery = memory_alloc(128);
+    memory_close_persistent();
+
+    // a file cut short no longer holds the heap its header describes
+    bool truncated = truncate(path.c_str(), 8192) == 0;
+    bool rejected = memory_open_persistent(path.c_str(), 0) == PERSIST_FAILED;
+    unlink(path.c_str());
+
+    // the sbrk heap must be usable again
+    void* back_on_sbrk = memory_alloc(32);
+    memory_free(back_on_sbrk);
+
+    printInfo("Read back " + std::to_string(count) + " nodes, " +
+              std::to_string(recovered_count) + " after a crash");
+
+    if (created && closed && resumed && recovered && count == 100 && sum == 4950 &&
+        recovered_count == 100 && after_recovery && truncated && rejected && back_on_sbrk &&
+        stays_in_file && sbrk_reused && switch_resumed && child_opened && held_exclusive) {
+        printInfo("Heap survived a clean restart and a crash, a truncated file was refused");
+        printInfo("Blocks freed across the switch went back to their own heap");
+        printInfo("A heap held open by another process could not be opened");
+        printTestPassed();
+    } else {
+        std::string err = "FAILED: Persistent heap lost data or failed to reopen";
+        printError(err);
+    }
+}
+
+void test_lifetime_sites() {
+    std::string msg = "Test 13: Lifetime Segregation by Site";
+    printTestName(msg);
+
+    const uint64_t LONG_SITE = 42;
+    const uint64_t SHORT_SITE = 43;
+
+    // long lived objects that stay around while plenty of short lived ones come and go
+    void* keep[40];
+    for (int i = 0; i < 40; i++) {
+        keep[i] = memory_alloc_site(64, LONG_SITE);
+    }
+    for (int i = 0; i < 1000; i++) {
+        memory_free(memory_alloc_site(4096, SHORT_SITE));
+    }
+
+    bool long_predicted = memory_site_is_long_lived(LONG_SITE);
+    bool short_predicted = !memory_site_is_long_lived(SHORT_SITE);
+
+    // the sites should now be placed apart, long lived ones at the high end
+    void* short_obj = memory_alloc_site(64, SHORT_SITE);
+    void* long_obj = memory_alloc_site(64, LONG_SITE);
+    bool separated = long_obj > short_obj;
+
+    // a size that wraps around once the trailer is added has to be refused
+    bool oversized_refused = memory_alloc_site(SIZE_MAX - 8, 44) == nullptr;
+
+    memory_free(short_obj);
+    memory_free(long_obj);
+    for (int i = 0; i < 40; i++) {
+        memory_free(keep[i]);
+    }
+
+    if (long_predicted && short_predicted && separated && oversized_refused) {
+        printInfo("Long lived site detected and placed above the short lived one");
+        printTestPassed();
+    } else {
+        std::string err = "FAILED: Site lifetimes mispredicted or not segregated";
+        printError(err);
+    }
+}
+
+void test_small_block_footprint() {
+    std::string msg = "Test 14: Small Block Footprint and Alignment";
+    printTestName(msg);
+
+#ifdef DMA_COMPACT_HEAP
+    // 4 byte tags: an 8 byte object fits a 16 byte block, payloads are 16 byte aligned
+    const size_t expected_block = 16;
+    const uintptr_t expected_alignment = 16;
+#else
+    const size_t expected_block = 32;
+    const uintptr_t expected_alignment = 8;
+#endif
+
+    heap_stats before;
+    memory_get_stats(&before);
+
+    void* tiny[100];
+    bool aligned = true;
+    for (int i = 0; i < 100; i++) {
+        tiny[i] = memory_alloc(8);
+        if ((uintptr_t)tiny[i] % expected_alignment != 0) aligned = false;
+    }
+
+    heap_stats after;
+    memory_get_stats(&after);
+    size_t per_block = (after.allocated_bytes - before.allocated_bytes) / 100;
+
+    for (int i = 0; i < 100; i++) {
+        memory_free(tiny[i]);
+    }
+
+    printInfo("8 byte objects take " + std::to_string(per_block) + " bytes each");
+
+    if (per_block == expected_block && aligned) {
+        printTestPassed();
+    } else {
+        std::string err = "FAILED: Unexpected block size or payload alignment";
+        printError(err);
+    }
+}
+
+void test_heap_snapshot() {
+    std::string msg = "Test 15: Heap Snapshot";
+    printTestName(msg);
+
+    std::string path = "/tmp/dma_snapshot_test_" + std::to_string(getpid()) + ".snap";
+
+    void* blocks[10];
+    for (int i = 0; i < 10; i++) {
+        blocks[i] = memory_alloc(100 * (i + 1));
+    }
+    memory_free(blocks[3]);
+    memory_free(blocks[7]);
+
+    heap_stats stats;
+    memory_get_stats(&stats);
+    bool written = memory_snapshot(path.c_str());
+
+    // reading it back the way the analyzer does
+    std::ifstream in(path, std::ios::binary);
+    snapshot_header hdr = {};
+    in.read((char*)&hdr, sizeof(hdr));
+
+    uint64_t allocated = 0, free_blocks = 0;
+    for (uint64_t i = 0; i < hdr.block_count && in; i++) {
+        snapshot_block blk;
+        in.read((char*)&blk, sizeof(blk));
+        if (blk.flags & SNAPSHOT_ALLOCATED) allocated++; else free_blocks++;
+    }
+    uint64_t listed = 0;
+    for (uint64_t i = 0; i < hdr.free_list_count && in; i++) {
+        uint64_t offset;
+        in.read((char*)&offset, sizeof(offset));
+        listed++;
+    }
+    bool complete = (bool)in && in.peek() == EOF;
+    unlink(path.c_str());
+
+    for (int i = 0; i < 10; i++) {
+        if (i != 3 && i != 7) memory_free(blocks[i]);
+    }
+
+    printInfo("Snapshot holds " + std::to_string(allocated) + " allocated and " +
+              std::to_string(free_blocks) + " free blocks");
+
+    if (written && complete && hdr.magic == SNAPSHOT_MAGIC && hdr.heap_size == stats.heap_size &&
+        allocated == stats.allocated_blocks && free_blocks == stats.free_blocks && listed == free_blocks) {
+        printTestPassed();
+    } else {
+        std::string err = "FAILED: Snapshot does not match the heap";
+        printError(err);
+    }
+}
+
+void test_shared_heap() {
+    std::string msg = "Test 16: Process-Shared Heap";
+    printTestName(msg);
+
+    std::string name = "/dma_shared_test_" + std::to_string(getpid());
+    shm_unlink(name.c_str());
+
+    void* private_front = memory_alloc(256);
+    void* private_blk = memory_alloc(256);
+    void* private_back = memory_alloc(256);
+
+    bool opened = memory_open_shared(name.c_str(), 1024 * 1024);
+
+    // a private block freed while attached goes back to the private heap, not the shared one
+    memory_free(private_blk);
+    bool stays_shared = true;
+    void* shared_blks[4];
+    for (int i = 0; i < 4; i++) {
+        shared_blks[i] = memory_alloc(256);
+        stays_shared = stays_shared && shared_blks[i] != private_blk &&
+                       memory_to_offset(shared_blks[i]) < 1024 * 1024;
+    }
+    for (int i = 0; i < 4; i++) {
+        memory_free(shared_blks[i]);
+    }
+
+    // a message for the other process, handed over as an offset
+    char* message = (char*)memory_alloc(64);
+    strcpy(message, "hello from the parent");
+    size_t message_offset = memory_to_offset(message);
+
+    int reply_pipe[2];
+    if (pipe(reply_pipe) != 0) {
+        std::string err = "FAILED: pipe";
+        printError(err);
+        return;
+    }
+
+    pid_t child = fork();
+    if (child == 0) {
+        // attaching from scratch, like an unrelated process would
+        memory_close_shared();
+        bool ok = memory_open_shared(name.c_str(), 0);
+
+        char* received = (char*)memory_from_offset(message_offset);
+        ok = ok && strcmp(received, "hello from the parent") == 0;
+        memory_free(received);
+
+        char* reply = (char*)memory_alloc(64);
+        strcpy(reply, "hello from the child");
+        size_t reply_offset = ok ? memory_to_offset(reply) : 0;
+        ssize_t written = write(reply_pipe[1], &reply_offset, sizeof(reply_offset));
+        _exit(written == sizeof(reply_offset) ? 0 : 1);
+    }
+
+    size_t reply_offset = 0;
+    bool got_reply = read(reply_pipe[0], &reply_offset, sizeof(reply_offset)) == sizeof(reply_offset);
+    waitpid(child, nullptr, 0);
+    close(reply_pipe[0]);
+    close(reply_pipe[1]);
+
+    char* reply = (char*)memory_from_offset(reply_offset);
+    bool exchanged = got_reply && reply_offset != 0 && strcmp(reply, "hello from the child") == 0;
+    memory_free(reply);
+
+    // children killed in the middle of allocating, some of them while holding the lock
+    char* survivor = (char*)memory_alloc(32);
+    strcpy(survivor, "still here");
+    for (int i = 0; i < 20; i++) {
+        pid_t worker = fork();
+        if (worker == 0) {
+            for (;;) {
+                memory_free(memory_alloc(16 + (i * 48) % 512));
+            }
+        }
+        usleep(2000);
+        kill(worker, SIGKILL);
+        waitpid(worker, nullptr, 0);
+    }
+
+    void* after_kills = memory_alloc(128);
+    bool survived = after_kills && strcmp(survivor, "still here") == 0;
+    printInfo("Lock recovered " + std::to_string(memory_shared_recoveries()) + " times after killed workers");
+
+    memory_free(after_kills);
+    memory_free(survivor);
+    memory_close_shared();
+    shm_unlink(name.c_str());
+
+    void* private_again = memory_alloc(256);
+    bool private_reused = private_again == private_blk;
+    memory_free(private_again);
+    memory_free(private_front);
+    memory_free(private_back);
+
+    // the same over a memfd, where the caller names the creator
+    int fd = memfd_create("dma_shared_test", 0);
+    bool fd_opened = fd >= 0 && memory_open_shared_fd(fd, 1024 * 1024, true);
+    char* fd_message = (char*)memory_alloc(64);
+    strcpy(fd_message, "hello over a memfd");
+    size_t fd_message_offset = memory_to_offset(fd_message);
+    memory_close_shared();
+
+    // formatting it a second time would wipe the message
+    bool reformat_refused = !memory_open_shared_fd(fd, 1024 * 1024, true);
+
+    pid_t attacher = fork();
+    if (attacher == 0) {
+        bool ok = memory_open_shared_fd(fd, 0, false);
+        ok = ok && strcmp((char*)memory_from_offset(fd_message_offset), "hello over a memfd") == 0;
+        _exit(ok ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(attacher, &status, 0);
+    bool fd_attached = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (fd >= 0) close(fd);
+
+    if (opened && exchanged && survived && fd_opened && reformat_refused && fd_attached &&
+        stays_shared && private_reused) {
+        printInfo("Message passed between processes without copying");
+        printInfo("Private block freed while attached went back to the private heap");
+        printTestPassed();
+    } else {
+        std::string err = "FAILED: Shared heap exchange or recovery failed";
+        printError(err);
+    }
+}
+
+long minorFaults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+void test_heap_reserve() {
+    std::string msg = "Test 17: Heap Reservation and Prefaulting";
+    printTestName(msg);
+
+    const size_t RESERVE = 32 * 1024 * 1024;
+
+    long before_reserve = minorFaults();
+    bool reserved = memory_reserve(RESERVE, RESERVE_PREFAULT);
+    long reserve_faults = minorFaults() - before_reserve;
+
+    heap_stats stats;
+    memory_get_stats(&stats);
+
+    // filling most of the reserved heap, none of it should fault or extend the heap
+    long before_use = minorFaults();
+    void* blocks[256];
+    for (int i = 0; i < 256; i++) {
+        blocks[i] = memory_alloc(64 * 1024);
+        memset(blocks[i], i, 64 * 1024);
+    }
+    long use_faults = minorFaults() - before_use;
+
+    heap_stats after;
+    memory_get_stats(&after);
+
+    for (int i = 0; i < 256; i++) {
+        memory_free(blocks[i]);
+    }
+
+    printInfo("Heap reserved to " + std::to_string(stats.heap_size) + " bytes, " +
+              std::to_string(reserve_faults) + " faults while reserving, " +
+              std::to_string(use_faults) + " while using 16MB of it");
+
+    if (reserved && stats.heap_size >= RESERVE && after.heap_size == stats.heap_size && use_faults < 16) {
+        printTestPassed();
+    } else {
+        std::string err = "FAILED: Reserved heap still faulted or grew on first use";
+        printError(err);
+    }
+}
+
+// stand-in for an application cache the pressure callback can evict
+struct evictable_cache {
+    void* blocks[4];
+    int evictions;
+    int calls;
+};
+
+void evictCache(size_t heap_size, size_t soft_limit, void* context) {
+    (void)heap_size;
+    (void)soft_limit;
+    evictable_cache* cache = (evictable_cache*)context;
+    cache->calls++;
+    for (int i = 0; i < 4; i++) {
+        if (cache->blocks[i]) {
+            memory_free(cache->blocks[i]);
+            cache->blocks[i] = nullptr;
+            cache->evictions++;
+        }
+    }
+}
+
+void test_memory_limits() {
+    std::string msg = "Test 18: Memory Limits and Pressure Callbacks";
+    printTestName(msg);
+
+    const size_t BLOCK = 1024 * 1024;
+
+    heap_stats start;
+    memory_get_stats(&start);
+
+    // every free byte counts against the limits too, so they sit just above the current heap
+    size_t soft_limit = start.heap_size + 4 * BLOCK;
+    size_t hard_limit = start.heap_size + 24 * BLOCK;
+    bool inverted_refused = !memory_set_limits(hard_limit, soft_limit);
+
+    evictable_cache cache = {};
+    for (int i = 0; i < 4; i++) {
+        cache.blocks[i] = memory_alloc(BLOCK);
+    }
+
+    bool limits_set = memory_set_limits(soft_limit, hard_limit);
+    bool registered = memory_add_pressure_callback(evictCache, &cache);
+
+    // allocating until the hard limit stops it
+    void* live[256];
+    int count = 0;
+    while (count < 256) {
+        live[count] = memory_alloc(BLOCK);
+        if (!live[count]) {
+            break;
+        }
+        count++;
+    }
+
+    heap_stats limited;
+    memory_get_stats(&limited);
+
+    memory_remove_pressure_callback(evictCache, &cache);
+    memory_set_limits(0, 0);
+
+    // with the limits lifted the heap grows again
+    void* unlimited = memory_alloc(BLOCK);
+    bool grew = unlimited != nullptr;
+    memory_free(unlimited);
+
+    for (int i = 0; i < count; i++) {
+        memory_free(live[i]);
+    }
+
+    printInfo("Allocated " + std::to_string(count) + " blocks of 1MB, heap stopped at " +
+              std::to_string(limited.heap_size) + " bytes (hard limit " + std::to_string(hard_limit) +
+              "), " + std::to_string(cache.evictions) + " cache blocks evicted in " +
+              std::to_string(cache.calls) + " pressure callbacks");
+
+    // one callback evicts the cache, one more finds nothing left and the heap crosses the soft
+    // limit; growing on above it must not call back again
+    if (inverted_refused && limits_set && registered && cache.evictions == 4 && cache.calls == 2 &&
+        count < 256 && limited.heap_size <= hard_limit && grew) {
+        printTestPassed();
+    } else {
+        std::string err = "FAILED: Heap went past its limits or pressure callbacks ran the wrong number of times";
+        printError(err);
+    }
+}
+
+void test_huge_block_coalescing() {
+    std::string msg = "Test 19: Coalescing Huge Blocks";
+    printTestName(msg);
+
+    const size_t GIB = 1024UL * 1024 * 1024;
+
+    // the pages are never touched, so this only costs address space
+    // (the compact heap stops growing at 4GiB, it runs out first)
+    void* blocks[6];
+    int count = 0;
+    while (count < 6) {
+        blocks[count] = memory_alloc(GIB);
+        if (!blocks[count]) {
+            break;
+        }
+        count++;
+    }
+
+    for (int i = 0; i < count; i++) {
+        memory_free(blocks[i]);
+    }
+
+    // all of it merged into a single free block whose tag still describes it
+    heap_stats stats;
+    memory_get_stats(&stats);
+    void* reuse = memory_alloc(stats.largest_free_block - GIB / 2);
+    heap_stats after;
+    memory_get_stats(&after);
+    memory_free(reuse);
+    memory_trim(0);
+
+    printInfo("Freed " + std::to_string(count) + " blocks of 1GiB in a " + std::to_string(stats.heap_size) +
+              " byte heap, largest free block " + std::to_string(stats.largest_free_block));
+
+    if (count >= 2 && stats.largest_free_block >= (size_t)count * GIB &&
+        stats.free_bytes + stats.allocated_bytes < stats.heap_size &&
+        stats.free_bytes + stats.allocated_bytes + 64 >= stats.heap_size &&
+        reuse && after.heap_size == stats.heap_size) {
+        printTestPassed();
+    } else {
+        std::string err = "FAILED: Coalesced block outgrew its tag";
+        printError(err);
+    }
+}
+
+// two call sites told apart only by where memory_alloc_site is called from
+// (their bodies differ so the compiler cannot fold them into one function)
+__attribute__((noinline)) void* allocAutoLongLived() {
+    return memory_alloc_site(64, MEMORY_SITE_AUTO);
+}
+
+__attribute__((noinline)) void* allocAutoShortLived(size_t size) {
+    return memory_alloc_site(size, MEMORY_SITE_AUTO);
+}
+
+void test_auto_sites() {
+    std::string msg = "Test 20: Lifetime Segregation by Return Address";
+    printTestName(msg);
+
+    // same pattern as Test 13, but the sites are told apart by their return addresses
+    void* keep[40];
+    for (int i = 0; i < 40; i++) {
+        keep[i] = allocAutoLongLived();
+    }
+    for (int i = 0; i < 1000; i++) {
+        memory_free(allocAutoShortLived(4096));
+    }
+
+    // placed apart in either order; a single site's objects would just follow the order
+    // they were allocated in
+    void* long_first = allocAutoLongLived();
+    void* short_second = allocAutoShortLived(64);
+    void* short_first = allocAutoShortLived(64);
+    void* long_second = allocAutoLongLived();
+    bool separated = long_first && short_second && short_first && long_second &&
+                     long_first > short_second && long_second > short_first;
+
+    memory_free(long_first);
+    memory_free(short_second);
+    memory_free(short_first);
+    memory_free(long_second);
+    for (int i = 0; i < 40; i++) {
+        memory_free(keep[i]);
+    }
+
+    if (separated) {
+        printInfo("Call sites without explicit ids were told apart and placed apart");
+        printTestPassed();
+    } else {
+        std::string err = "FAILED: MEMORY_SITE_AUTO did not separate the call sites";
+        printError(err);
+    }
+}
+
 int main(){
     initialize_heap();
 
@@ -449,6 +1338,18 @@ int main(){
     test_block_splitting();
     test_heap_extension();
     test_edge_cases();
+    test_alloc_flags();
+    test_latency_percentiles();
+    test_handle_compaction();
+    test_persistent_heap();
+    test_lifetime_sites();
+    test_small_block_footprint();
+    test_heap_snapshot();
+    test_shared_heap();
+    test_heap_reserve();
+    test_memory_limits();
+    test_huge_block_coalescing();
+    test_auto_sites();
 
     std::cout << "\033[1m\033[32m========================================\033[0m\n";
     std::cout << "\033[1m\033[32mALL CORRECTNESS TESTS COMPLETED\033[0m\n";
@@ -0,0 +1,279 @@
+#include "../src/heap_snapshot.hpp"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <set>
+
+// offline analysis of memory_snapshot() files
+//
+//   heap_analyzer <snapshot>           report on one snapshot
+//   heap_analyzer <before> <after>     report on <after> plus what changed since <before>
+
+const int SIZE_CLASSES = 48;   // log2 buckets of free block sizes
+const int ADDRESS_BANDS = 16;  // slices of the heap for the fragmentation map
+
+struct snapshot {
+    snapshot_header header;
+    std::vector<snapshot_block> blocks;
+    std::vector<uint64_t> free_list;
+};
+
+bool loadSnapshot(const std::string& path, snapshot& snap){
+    std::ifstream in(path, std::ios::binary);
+    if (!in){
+        std::cerr << "cannot open " << path << "\n";
+        return false;
+    }
+
+    in.seekg(0, std::ios::end);
+    uint64_t file_size = in.tellg();
+    in.seekg(0, std::ios::beg);
+
+    in.read((char*)&snap.header, sizeof(snap.header));
+    const snapshot_header& h = snap.header;
+    if (!in || h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION || (h.tag_size != 4 && h.tag_size != 8)){
+        std::cerr << path << " is not a heap snapshot (or has an unsupported version)\n";
+        return false;
+    }
+
+    // the counts come from the file, they have to fit in it before anything is sized by them
+    uint64_t body_size = file_size - sizeof(snapshot_header);
+    if (h.block_count > body_size / sizeof(snapshot_block) ||
+        h.free_list_count > (body_size - h.block_count * sizeof(snapshot_block)) / sizeof(uint64_t)){
+        std::cerr << path << " is truncated\n";
+        return false;
+    }
+
+    snap.blocks.resize(h.block_count);
+    snap.free_list.resize(h.free_list_count);
+    in.read((char*)snap.blocks.data(), snap.blocks.size() * sizeof(snapshot_block));
+    in.read((char*)snap.free_list.data(), snap.free_list.size() * sizeof(uint64_t));
+    if (!in){
+        std::cerr << path << " is truncated\n";
+        return false;
+    }
+
+    for (const snapshot_block& blk : snap.blocks){
+        if (blk.offset >= h.heap_size || blk.size > h.heap_size - blk.offset){
+            std::cerr << path << " has a block outside the heap\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+int sizeClass(uint64_t size){
+    int cls = 0;
+    while (size > 1 && cls < SIZE_CLASSES - 1){
+        size >>= 1;
+        cls++;
+    }
+    return cls;
+}
+
+// free block count and bytes per log2 size class
+void freeDistribution(const snapshot& snap, uint64_t counts[SIZE_CLASSES], uint64_t bytes[SIZE_CLASSES]){
+    for (int i = 0; i < SIZE_CLASSES; i++){
+        counts[i] = bytes[i] = 0;
+    }
+    for (const snapshot_block& blk : snap.blocks){
+        if (!(blk.flags & SNAPSHOT_ALLOCATED)){
+            counts[sizeClass(blk.size)]++;
+            bytes[sizeClass(blk.size)] += blk.size;
+        }
+    }
+}
+
+void printSummary(const std::string& path, const snapshot& snap){
+    const snapshot_header& h = snap.header;
+    double fragmentation = h.free_bytes ? 1.0 - (double)h.largest_free_block / h.free_bytes : 0.0;
+
+    std::cout << "== " << path << "\n";
+    std::cout << "heap size          " << h.heap_size << " bytes (" << h.tag_size << " byte tags)\n";
+    std::cout << "allocated          " << h.allocated_blocks << " blocks, " << h.allocated_bytes << " bytes\n";
+    std::cout << "free               " << h.free_blocks << " blocks, " << h.free_bytes << " bytes\n";
+    std::cout << "largest free block " << h.largest_free_block << " bytes\n";
+    std::cout << "fragmentation      " << std::fixed << std::setprecision(3) << fragmentation
+              << " (share of free bytes outside the largest free block)\n";
+
+    if (h.free_list_count != h.free_blocks){
+        std::cout << "WARNING: free list has " << h.free_list_count << " entries for "
+                  << h.free_blocks << " free blocks\n";
+    }
+    std::cout << "\n";
+}
+
+void printFreeDistribution(const snapshot& snap){
+    uint64_t counts[SIZE_CLASSES], bytes[SIZE_CLASSES];
+    freeDistribution(snap, counts, bytes);
+
+    std::cout << "free block sizes\n";
+    std::cout << std::setw(24) << "size range" << std::setw(12) << "blocks" << std::setw(16) << "bytes" << "\n";
+    for (int i = 0; i < SIZE_CLASSES; i++){
+        if (counts[i] == 0) continue;
+        std::string range = std::to_string(1ULL << i) + " - " + std::to_string((2ULL << i) - 1);
+        std::cout << std::setw(24) << range << std::setw(12) << counts[i] << std::setw(16) << bytes[i] << "\n";
+    }
+    std::cout << "\n";
+}
+
+// free share of each slice of the heap, shows where the holes are
+void printAddressMap(const snapshot& snap){
+    uint64_t heap_size = snap.header.heap_size;
+    if (heap_size == 0) return;
+
+    uint64_t band_size = (heap_size + ADDRESS_BANDS - 1) / ADDRESS_BANDS;
+    uint64_t free_in_band[ADDRESS_BANDS] = {};
+    uint64_t blocks_in_band[ADDRESS_BANDS] = {};
+
+    for (const snapshot_block& blk : snap.blocks){
+        blocks_in_band[blk.offset / band_size]++;
+        if (blk.flags & SNAPSHOT_ALLOCATED) continue;
+
+        // spreading the free block over the bands it covers
+        uint64_t start = blk.offset, end = blk.offset + blk.size;
+        while (start < end){
+            uint64_t band = start / band_size;
+            uint64_t band_end = (band + 1) * band_size;
+            uint64_t chunk = (end < band_end ? end : band_end) - start;
+            free_in_band[band] += chunk;
+            start += chunk;
+        }
+    }
+
+    std::cout << "fragmentation over address space (" << band_size << " bytes per band)\n";
+    for (int i = 0; i < ADDRESS_BANDS; i++){
+        double free_share = (double)free_in_band[i] / band_size;
+        int bar = (int)(free_share * 40 + 0.5);
+        std::cout << "  +" << std::setw(12) << std::left << (uint64_t)i * band_size << std::right
+                  << std::setw(7) << std::setprecision(1) << free_share * 100 << "% free "
+                  << std::setw(8) << blocks_in_band[i] << " blocks  |"
+                  << std::string(bar, '#') << std::string(40 - bar, '.') << "|\n";
+    }
+    std::cout << "\n";
+}
+
+// size of the block the allocator carves for a request: header and footer tags around the
+// payload, aligned, and never smaller than a free block (two tags and two free list links)
+uint64_t blockSizeFor(uint64_t request, uint64_t tag_size){
+    const uint64_t ALIGNMENT = 16;
+    uint64_t block = (request + 2 * tag_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    uint64_t min_block = (4 * tag_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    return block < min_block ? min_block : block;
+}
+
+// for each request size, how many such requests the current free blocks could still serve
+void printLargestFit(const snapshot& snap){
+    std::cout << "largest-fit curve\n";
+    std::cout << std::setw(14) << "request" << std::setw(16) << "fits" << std::setw(18) << "blocks able" << "\n";
+
+    for (int cls = 4; cls < SIZE_CLASSES; cls++){
+        uint64_t request = 1ULL << cls;
+        uint64_t block = blockSizeFor(request, snap.header.tag_size);
+        if (block > snap.header.largest_free_block && cls > 4){
+            std::cout << std::setw(14) << request << std::setw(16) << 0 << std::setw(18) << 0 << "\n";
+            break;
+        }
+
+        uint64_t fits = 0, blocks = 0;
+        for (const snapshot_block& blk : snap.blocks){
+            if (!(blk.flags & SNAPSHOT_ALLOCATED) && blk.size >= block){
+                fits += blk.size / block;
+                blocks++;
+            }
+        }
+        std::cout << std::setw(14) << request << std::setw(16) << fits << std::setw(18) << blocks << "\n";
+    }
+    std::cout << "\n";
+}
+
+template <typename T>
+std::string signedDelta(T before, T after){
+    long long delta = (long long)after - (long long)before;
+    return (delta > 0 ? "+" : "") + std::to_string(delta);
+}
+
+void printDiff(const snapshot& before, const snapshot& after){
+    const snapshot_header& a = before.header;
+    const snapshot_header& b = after.header;
+
+    std::cout << "== changes\n";
+    std::cout << "heap size          " << signedDelta(a.heap_size, b.heap_size) << " bytes\n";
+    std::cout << "allocated          " << signedDelta(a.allocated_blocks, b.allocated_blocks) << " blocks, "
+              << signedDelta(a.allocated_bytes, b.allocated_bytes) << " bytes\n";
+    std::cout << "free               " << signedDelta(a.free_blocks, b.free_blocks) << " blocks, "
+              << signedDelta(a.free_bytes, b.free_bytes) << " bytes\n";
+    std::cout << "largest free block " << signedDelta(a.largest_free_block, b.largest_free_block) << " bytes\n";
+    if (a.heap_base != b.heap_base){
+        std::cout << "(heap was at a different address, offsets are still comparable)\n";
+    }
+
+    // allocated blocks that appeared or went away, matched by offset and size
+    std::set<std::pair<uint64_t, uint64_t>> old_allocated;
+    for (const snapshot_block& blk : before.blocks){
+        if (blk.flags & SNAPSHOT_ALLOCATED) old_allocated.insert({blk.offset, blk.size});
+    }
+    uint64_t appeared = 0, appeared_bytes = 0;
+    for (const snapshot_block& blk : after.blocks){
+        if (!(blk.flags & SNAPSHOT_ALLOCATED)) continue;
+        if (old_allocated.erase({blk.offset, blk.size}) == 0){
+            appeared++;
+            appeared_bytes += blk.size;
+        }
+    }
+    uint64_t gone_bytes = 0;
+    for (const auto& blk : old_allocated){
+        gone_bytes += blk.second;
+    }
+    std::cout << "new allocations    " << appeared << " blocks, " << appeared_bytes << " bytes\n";
+    std::cout << "released           " << old_allocated.size() << " blocks, " << gone_bytes << " bytes\n\n";
+
+    uint64_t a_counts[SIZE_CLASSES], a_bytes[SIZE_CLASSES], b_counts[SIZE_CLASSES], b_bytes[SIZE_CLASSES];
+    freeDistribution(before, a_counts, a_bytes);
+    freeDistribution(after, b_counts, b_bytes);
+
+    std::cout << "free block sizes, change\n";
+    std::cout << std::setw(24) << "size range" << std::setw(12) << "blocks" << std::setw(16) << "bytes" << "\n";
+    for (int i = 0; i < SIZE_CLASSES; i++){
+        if (a_counts[i] == b_counts[i] && a_bytes[i] == b_bytes[i]) continue;
+        std::string range = std::to_string(1ULL << i) + " - " + std::to_string((2ULL << i) - 1);
+        std::cout << std::setw(24) << range
+                  << std::setw(12) << signedDelta(a_counts[i], b_counts[i])
+                  << std::setw(16) << signedDelta(a_bytes[i], b_bytes[i]) << "\n";
+    }
+    std::cout << "\n";
+}
+
+int main(int argc, char** argv){
+    if (argc != 2 && argc != 3){
+        std::cerr << "usage: " << argv[0] << " <snapshot> [<later snapshot>]\n";
+        return 2;
+    }
+
+    snapshot first;
+    if (!loadSnapshot(argv[1], first)){
+        return 1;
+    }
+
+    if (argc == 2){
+        printSummary(argv[1], first);
+        printFreeDistribution(first);
+        printAddressMap(first);
+        printLargestFit(first);
+        return 0;
+    }
+
+    snapshot second;
+    if (!loadSnapshot(argv[2], second)){
+        return 1;
+    }
+
+    printSummary(argv[2], second);
+    printFreeDistribution(second);
+    printAddressMap(second);
+    printLargestFit(second);
+    printDiff(first, second);
+    return 0;
+}